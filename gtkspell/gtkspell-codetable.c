@@ -24,7 +24,9 @@
 #include "gtkspell-codetable.h"
 #include "../config.h"
 #include <libintl.h>
+#include <locale.h>
 #include <string.h>
+#include <glib/gstdio.h>
 
 #ifdef G_OS_WIN32
 #include "gtkspell-win32.h"
@@ -33,8 +35,42 @@
 #define ISO_639_DOMAIN	"iso_639"
 #define ISO_3166_DOMAIN	"iso_3166"
 
-static GHashTable *iso_639_table = NULL;
-static GHashTable *iso_3166_table = NULL;
+/* The translated names are compiled into a table of this layout:
+ *
+ *   header | language entries | country entries | strings
+ *
+ * Entries are sorted by code and refer to their NUL-terminated strings
+ * by offset from the start of the table. The table is cached in the
+ * user's cache dir, so that later processes map it instead of parsing the
+ * XML files and translating every entry. The cached file is specific to
+ * the locale, and to the XML files and message catalogs it was compiled
+ * from, as they are when it is opened. */
+#define CODETABLE_CACHE_MAGIC "GSPCODE1"
+#define CODETABLE_CACHE_BYTE_ORDER 0x01020304
+
+typedef struct _CodetableCacheHeader CodetableCacheHeader;
+struct _CodetableCacheHeader
+{
+  gchar magic[8];
+  guint32 byte_order;
+  guint32 key;
+  guint32 n_languages;
+  guint32 languages;
+  guint32 n_countries;
+  guint32 countries;
+};
+
+typedef struct _CodetableCacheEntry CodetableCacheEntry;
+struct _CodetableCacheEntry
+{
+  guint32 code;
+  guint32 name;
+};
+
+/* set up once and kept for the life of the process, so lookups need no
+ * locking */
+static GBytes *table = NULL;
+static const gchar *table_data = NULL;
 
 static void
 iso_639_start_element (GMarkupParseContext *context,
@@ -129,13 +165,184 @@ iso_codes_parse (const GMarkupParser *parser,
     }
 }
 
-/**
- * codetable_init:
- *
- * Initializes the code table.
- */
-void
-codetable_init (void)
+/* appends the modification time and the size of @path to @key */
+static void
+codetable_cache_key_add_file (GString *key, const gchar *path)
+{
+  GStatBuf st;
+
+  if (g_stat (path, &st) == 0)
+    g_string_append_printf (key, ";%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+                            (gint64) st.st_mtime, (gint64) st.st_size);
+  else
+    g_string_append (key, ";-");
+}
+
+/* tells what the cached names depend on. an update of iso-codes or of its
+ * translations replaces the files the names come from, even if gtkspell
+ * isn't rebuilt, so they are part of the key. */
+static gchar*
+codetable_cache_key (void)
+{
+  static const gchar *const domains[] = { ISO_639_DOMAIN, ISO_3166_DOMAIN };
+  const gchar *const *names = g_get_language_names ();
+  const gchar *language = g_getenv ("LANGUAGE");
+  const gchar *locale = setlocale (LC_MESSAGES, NULL);
+  gchar *basename, *path;
+  GString *key;
+  guint i, j;
+
+  key = g_string_new (NULL);
+  g_string_append_printf (key, "%s;%s", locale ? locale : "",
+                          language ? language : "");
+
+  for (i = 0; i < G_N_ELEMENTS (domains); i++)
+    {
+      basename = g_strconcat (domains[i], ".xml", NULL);
+      path = g_build_filename (ISO_CODES_PREFIX, "share", "xml", "iso-codes",
+                               basename, NULL);
+      codetable_cache_key_add_file (key, path);
+      g_free (path);
+      g_free (basename);
+
+      /* the catalogs gettext may take the translations from */
+      basename = g_strconcat (domains[i], ".mo", NULL);
+      for (j = 0; names[j]; j++)
+        {
+          if (strcmp (names[j], "C") == 0)
+            continue;
+          path = g_build_filename (ISO_CODES_LOCALEDIR, names[j], "LC_MESSAGES",
+                                   basename, NULL);
+          if (g_file_test (path, G_FILE_TEST_EXISTS))
+            {
+              g_string_append_printf (key, ";%s", names[j]);
+              codetable_cache_key_add_file (key, path);
+            }
+          g_free (path);
+        }
+      g_free (basename);
+    }
+
+  return g_string_free (key, FALSE);
+}
+
+/* the file is named by the locale part of @key only, so that a stale one
+ * is overwritten rather than left behind */
+static gchar*
+codetable_cache_path (const gchar *key)
+{
+  gchar *basename, *path, *locale;
+  const gchar *p;
+
+  p = strchr (key, ';');
+  p = strchr (p + 1, ';');
+  locale = g_strndup (key, p ? (gsize) (p - key) : strlen (key));
+  basename = g_strdup_printf ("codetable-%08x.bin", g_str_hash (locale));
+  g_free (locale);
+  path = g_build_filename (g_get_user_cache_dir (), "gtkspell", basename, NULL);
+  g_free (basename);
+
+  return path;
+}
+
+static gboolean
+codetable_entries_valid (const gchar *contents, gsize length,
+                         guint32 offset, guint32 n_entries)
+{
+  const CodetableCacheEntry *entries;
+  guint32 i;
+
+  if (offset % sizeof (guint32) != 0 || offset > length ||
+      n_entries > (length - offset) / sizeof (CodetableCacheEntry))
+    return FALSE;
+
+  entries = (const CodetableCacheEntry *) (contents + offset);
+  for (i = 0; i < n_entries; i++)
+    if (entries[i].code >= length || entries[i].name >= length)
+      return FALSE;
+
+  return TRUE;
+}
+
+static GBytes*
+codetable_cache_open (const gchar *path, const gchar *key)
+{
+  GMappedFile *mapped_file;
+  const CodetableCacheHeader *header;
+  const gchar *contents;
+  gsize length;
+  GBytes *bytes = NULL;
+
+  mapped_file = g_mapped_file_new (path, FALSE, NULL);
+  if (mapped_file == NULL)
+    return NULL;
+
+  contents = g_mapped_file_get_contents (mapped_file);
+  length = g_mapped_file_get_length (mapped_file);
+  header = (const CodetableCacheHeader *) contents;
+
+  /* the last string ends the file, so every string is terminated */
+  if (length >= sizeof (CodetableCacheHeader) && contents[length - 1] == '\0' &&
+      memcmp (header->magic, CODETABLE_CACHE_MAGIC, sizeof (header->magic)) == 0 &&
+      header->byte_order == CODETABLE_CACHE_BYTE_ORDER &&
+      header->key < length && strcmp (contents + header->key, key) == 0 &&
+      codetable_entries_valid (contents, length, header->languages,
+                               header->n_languages) &&
+      codetable_entries_valid (contents, length, header->countries,
+                               header->n_countries))
+    bytes = g_mapped_file_get_bytes (mapped_file);
+
+  g_mapped_file_unref (mapped_file);
+
+  return bytes;
+}
+
+static guint32
+codetable_add_string (GByteArray *data, const gchar *str)
+{
+  guint32 offset = data->len;
+
+  g_byte_array_append (data, (const guint8 *) str, strlen (str) + 1);
+  return offset;
+}
+
+/* appends the entries of @hash_table and their strings, returns the
+ * offset of the entries */
+static guint32
+codetable_add_entries (GByteArray *data, GHashTable *hash_table)
+{
+  CodetableCacheEntry *entry;
+  GList *codes, *l;
+  guint32 offset, i;
+
+  offset = data->len;
+  g_byte_array_set_size (data, offset +
+                         g_hash_table_size (hash_table) * sizeof (CodetableCacheEntry));
+
+  codes = g_list_sort (g_hash_table_get_keys (hash_table), (GCompareFunc) strcmp);
+  for (l = codes, i = 0; l; l = l->next, i++)
+    {
+      guint32 code = codetable_add_string (data, l->data);
+      guint32 name = codetable_add_string (data,
+                                           g_hash_table_lookup (hash_table, l->data));
+
+      /* the array may have moved */
+      entry = (CodetableCacheEntry *) (data->data + offset) + i;
+      entry->code = code;
+      entry->name = name;
+    }
+  g_list_free (codes);
+
+  /* keep the following entries aligned */
+  while (data->len % sizeof (guint32) != 0)
+    g_byte_array_append (data, (const guint8 *) "", 1);
+
+  return offset;
+}
+
+/* parses the XML files into a table */
+static GBytes*
+codetable_compile (const gchar *key)
 {
   GMarkupParser iso_639_parser = {
     iso_639_start_element, NULL, NULL, NULL, NULL
@@ -144,17 +351,9 @@ codetable_init (void)
   GMarkupParser iso_3166_parser = {
     iso_3166_start_element, NULL, NULL, NULL, NULL
   };
-
-  g_return_if_fail (iso_639_table == NULL);
-  g_return_if_fail (iso_3166_table == NULL);
-
-#ifdef ENABLE_NLS
-  bindtextdomain (ISO_639_DOMAIN, ISO_CODES_LOCALEDIR);
-  bind_textdomain_codeset (ISO_639_DOMAIN, "UTF-8");
-
-  bindtextdomain (ISO_3166_DOMAIN, ISO_CODES_LOCALEDIR);
-  bind_textdomain_codeset (ISO_3166_DOMAIN, "UTF-8");
-#endif
+  CodetableCacheHeader header;
+  GHashTable *iso_639_table, *iso_3166_table;
+  GByteArray *data;
 
   iso_639_table = g_hash_table_new_full (g_str_hash, g_str_equal,
                              (GDestroyNotify) g_free, (GDestroyNotify) g_free);
@@ -163,69 +362,188 @@ codetable_init (void)
 
   iso_codes_parse (&iso_639_parser, "iso_639.xml", iso_639_table);
   iso_codes_parse (&iso_3166_parser, "iso_3166.xml", iso_3166_table);
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CODETABLE_CACHE_MAGIC, sizeof (header.magic));
+  header.byte_order = CODETABLE_CACHE_BYTE_ORDER;
+  header.n_languages = g_hash_table_size (iso_639_table);
+  header.n_countries = g_hash_table_size (iso_3166_table);
+
+  data = g_byte_array_new ();
+  g_byte_array_set_size (data, sizeof (CodetableCacheHeader));
+  header.languages = codetable_add_entries (data, iso_639_table);
+  header.countries = codetable_add_entries (data, iso_3166_table);
+  header.key = codetable_add_string (data, key);
+  memcpy (data->data, &header, sizeof (header));
+
+  g_hash_table_unref (iso_639_table);
+  g_hash_table_unref (iso_3166_table);
+
+  return g_byte_array_free_to_bytes (data);
+}
+
+static void
+codetable_cache_write (const gchar *path, GBytes *bytes)
+{
+  gchar *dir;
+  gsize length;
+  const gchar *contents;
+  GError *error = NULL;
+
+  contents = g_bytes_get_data (bytes, &length);
+  dir = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dir, 0755) != 0 ||
+      !g_file_set_contents (path, contents, length, &error))
+    {
+      /* the XML files are parsed again next time, nothing more */
+      if (error)
+        {
+          g_debug ("%s: %s", path, error->message);
+          g_error_free (error);
+        }
+    }
+  g_free (dir);
+}
+
+/* finds the name for the code of @len bytes at @code. the codes in each
+ * list share their case, so ignoring it keeps the order. */
+static const gchar*
+codetable_find (guint32 offset, guint32 n_entries, const gchar *code, gsize len)
+{
+  const CodetableCacheEntry *entries;
+  guint32 lo = 0, hi = n_entries;
+
+  entries = (const CodetableCacheEntry *) (table_data + offset);
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      const gchar *entry = table_data + entries[mid].code;
+      gint cmp = g_ascii_strncasecmp (code, entry, len);
+
+      /* a code that is a prefix of the entry sorts before it */
+      if (cmp == 0 && entry[len] != '\0')
+        cmp = -1;
+
+      if (cmp == 0)
+        return table_data + entries[mid].name;
+      if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return NULL;
 }
 
 /**
- * codetable_free:
+ * codetable_init:
  *
- * Frees the code table.
+ * Sets the code table up, unless done already. The table is kept for the
+ * life of the process. It is safe to call this from any thread.
  */
 void
-codetable_free (void)
+codetable_init (void)
 {
-  g_return_if_fail (iso_639_table != NULL);
-  g_return_if_fail (iso_3166_table != NULL);
+  static gsize initialized = 0;
+  gchar *key, *path;
 
-  g_hash_table_unref (iso_639_table);
-  g_hash_table_unref (iso_3166_table);
+  if (!g_once_init_enter (&initialized))
+    return;
+
+#ifdef ENABLE_NLS
+  bindtextdomain (ISO_639_DOMAIN, ISO_CODES_LOCALEDIR);
+  bind_textdomain_codeset (ISO_639_DOMAIN, "UTF-8");
+
+  bindtextdomain (ISO_3166_DOMAIN, ISO_CODES_LOCALEDIR);
+  bind_textdomain_codeset (ISO_3166_DOMAIN, "UTF-8");
+#endif
+
+  key = codetable_cache_key ();
+  path = codetable_cache_path (key);
 
-  iso_639_table = NULL;
-  iso_3166_table = NULL;
+  table = codetable_cache_open (path, key);
+  if (table == NULL)
+    {
+      table = codetable_compile (key);
+      if (((const CodetableCacheHeader *) g_bytes_get_data (table, NULL))->n_languages > 0)
+        codetable_cache_write (path, table);
+    }
+  table_data = g_bytes_get_data (table, NULL);
+
+  g_free (path);
+  g_free (key);
+
+  g_once_init_leave (&initialized, 1);
 }
 
 /**
  * codetable_lookup:
- * @language_code: A language code (i.e. "en_US")
- * @language_name: (out) (transfer none): Pointer to the name of the language.
- * This pointer is owned by the code table and must not be freed.
- * @country_name: (out) (transfer none): Pointer to the name of the country.
- * This pointer is owned by the code table and must not be freed.
+ * @language_code: A language code (i.e. "en_US", "en-US" or "sr_RS@latin")
+ * @name: (out caller-allocates): The parts of the name.
  *
- * Looks up the language and country name for the specified language code.
- * If no matching entries are found, language_name and country_name will
- * simply contain the parts of the language code (i.e. "en" and "US").
+ * Looks up the language and country name for the specified language code,
+ * setting up the code table if needed. The code is parsed in place and
+ * nothing is allocated. The parts of @name point into the code table, or
+ * into @language_code where no matching entries are found, and are not
+ * NUL-terminated: use their lengths. A country or a variant that the code
+ * doesn't name has a length of 0.
  */
 void
-codetable_lookup (const gchar *language_code, const gchar **language_name, const gchar** country_name)
+codetable_lookup (const gchar *language_code, CodetableName *name)
 {
-  gchar **parts;
-
-  g_return_if_fail (iso_639_table != NULL);
-  g_return_if_fail (iso_3166_table != NULL);
-
-  /* Split language code into parts. */
-  parts = g_strsplit (language_code, "_", 2);
-
-  g_return_if_fail (*parts != NULL);
-
-  *language_name = g_hash_table_lookup (iso_639_table, parts[0]);
-  if (*language_name == NULL)
+  const CodetableCacheHeader *header;
+  const gchar *p, *subtag;
+  gsize len;
+
+  codetable_init ();
+  header = (const CodetableCacheHeader *) table_data;
+  memset (name, 0, sizeof (*name));
+
+  p = language_code;
+  len = strcspn (p, "-_.@");
+  name->language = codetable_find (header->languages, header->n_languages, p, len);
+  if (name->language)
+    name->language_len = strlen (name->language);
+  else
     {
-      g_hash_table_insert (iso_639_table, g_strdup (parts[0]),
-                           g_strdup (parts[0]));
-      *language_name = g_hash_table_lookup (iso_639_table, parts[0]);
+      name->language = p;
+      name->language_len = len;
     }
+  p += len;
 
-  if (g_strv_length (parts) == 2)
+  /* the region, and a script as the variant: "sr-Latn-RS" */
+  while (*p == '-' || *p == '_')
     {
-      *country_name = g_hash_table_lookup (iso_3166_table, parts[1]);
-      if (*country_name == NULL)
+      subtag = ++p;
+      len = strcspn (p, "-_.@");
+      p += len;
+
+      if (name->country_len == 0 &&
+          (len == 2 || (len == 3 && g_ascii_isdigit (subtag[0]))))
+        {
+          name->country = codetable_find (header->countries,
+                                          header->n_countries, subtag, len);
+          if (name->country)
+            name->country_len = strlen (name->country);
+          else
+            {
+              name->country = subtag;
+              name->country_len = len;
+            }
+        }
+      else if (name->variant_len == 0 && len > 0)
         {
-          g_hash_table_insert (iso_3166_table, g_strdup (parts[1]),
-                               g_strdup (parts[1]));
-          *country_name = g_hash_table_lookup (iso_3166_table, parts[1]);
+          name->variant = subtag;
+          name->variant_len = len;
         }
     }
 
-  g_strfreev (parts);
+  /* an encoding is of no interest, a modifier is the variant */
+  if (*p == '.')
+    p += strcspn (p, "@");
+  if (*p == '@' && name->variant_len == 0)
+    {
+      name->variant = p + 1;
+      name->variant_len = strcspn (p + 1, ".");
+    }
 }
@@ -28,11 +28,20 @@
 
 G_BEGIN_DECLS
 
+typedef struct _CodetableName CodetableName;
+struct _CodetableName
+{
+  const gchar *language;
+  gint language_len;
+  const gchar *country;
+  gint country_len;
+  const gchar *variant;
+  gint variant_len;
+};
+
 void codetable_init   (void);
-void codetable_free   (void);
 void codetable_lookup (const gchar *language_code,
-                       const gchar **language_name,
-                       const gchar **country_name);
+                       CodetableName *name);
 
 G_END_DECLS
 
@@ -0,0 +1,474 @@
+/* gtkspell - a spell-checking addon for GTK's TextView widget
+ * Copyright (c) 2002 Evan Martin
+ * Copyright (c) 2012-2013 Sandro Mani
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* vim: set ts=4 sw=4 wm=5 : */
+
+/* Word segmentation for the checker.
+ *
+ * The words of the text are found in a single forward pass over the UTF-8
+ * text: a word is a run of letters, digits and combining marks, which the
+ * following characters join as long as a word character follows them:
+ *  - an apostrophe (a single quote, or U+2019) followed by a letter,
+ *    the heuristic the checker has always applied on top of pango, which
+ *    doesn't keep words like "doesn't" together,
+ *  - a period between two letters or two digits, a comma between two
+ *    digits, and an underscore, as pango does.
+ *
+ * Scripts written without spaces between the words need a dictionary to
+ * find the word boundaries, which only pango has.  once such a character
+ * shows up, the run of text around it is left to pango, up to the next
+ * letter of another script or the end of the paragraph, and the words after
+ * it are found the usual way again.
+ *
+ * Runs of ASCII, which most text is made of, are classified 16 or 32 bytes
+ * at a time where the CPU allows, see ascii_span. */
+
+#include "gtkspell-segment.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define SEGMENT_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* ascii_span returns the length of the run of ASCII bytes at the start of
+ * @p which are alphanumeric if @word is set, or not alphanumeric if it isn't.
+ * in both cases the run ends at the first byte which isn't ASCII. */
+
+static gsize
+ascii_span_scalar (const gchar *p, gsize len, gboolean word)
+{
+  gsize i;
+
+  for (i = 0; i < len && (guchar) p[i] < 0x80; i++)
+    if ((g_ascii_isalnum (p[i]) != FALSE) != word)
+      break;
+  return i;
+}
+
+#ifdef SEGMENT_SIMD
+/* the bytes are compared as signed values, which keeps the ones
+ * above 0x7f out of every range */
+static gsize
+ascii_span_sse2 (const gchar *p, gsize len, gboolean word)
+{
+  const __m128i case_bit = _mm_set1_epi8 (0x20);
+  const __m128i a = _mm_set1_epi8 ('a' - 1), z = _mm_set1_epi8 ('z' + 1);
+  const __m128i d0 = _mm_set1_epi8 ('0' - 1), d9 = _mm_set1_epi8 ('9' + 1);
+  gsize i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+      __m128i lower = _mm_or_si128 (v, case_bit);
+      __m128i alpha = _mm_and_si128 (_mm_cmpgt_epi8 (lower, a), _mm_cmpgt_epi8 (z, lower));
+      __m128i digit = _mm_and_si128 (_mm_cmpgt_epi8 (v, d0), _mm_cmpgt_epi8 (d9, v));
+      guint alnum = _mm_movemask_epi8 (_mm_or_si128 (alpha, digit));
+      guint stop;
+
+      if (word)
+        stop = ~alnum & 0xffff;
+      else
+        stop = alnum | _mm_movemask_epi8 (v);
+      if (stop)
+        return i + __builtin_ctz (stop);
+    }
+
+  return i + ascii_span_scalar (p + i, len - i, word);
+}
+
+__attribute__ ((target ("avx2")))
+static gsize
+ascii_span_avx2 (const gchar *p, gsize len, gboolean word)
+{
+  const __m256i case_bit = _mm256_set1_epi8 (0x20);
+  const __m256i a = _mm256_set1_epi8 ('a' - 1), z = _mm256_set1_epi8 ('z' + 1);
+  const __m256i d0 = _mm256_set1_epi8 ('0' - 1), d9 = _mm256_set1_epi8 ('9' + 1);
+  gsize i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (p + i));
+      __m256i lower = _mm256_or_si256 (v, case_bit);
+      __m256i alpha = _mm256_and_si256 (_mm256_cmpgt_epi8 (lower, a), _mm256_cmpgt_epi8 (z, lower));
+      __m256i digit = _mm256_and_si256 (_mm256_cmpgt_epi8 (v, d0), _mm256_cmpgt_epi8 (d9, v));
+      guint alnum = _mm256_movemask_epi8 (_mm256_or_si256 (alpha, digit));
+      guint stop;
+
+      if (word)
+        stop = ~alnum;
+      else
+        stop = alnum | (guint) _mm256_movemask_epi8 (v);
+      if (stop)
+        return i + __builtin_ctz (stop);
+    }
+
+  return i + ascii_span_sse2 (p + i, len - i, word);
+}
+#endif
+
+typedef gsize (*AsciiSpanFunc) (const gchar *p, gsize len, gboolean word);
+
+static AsciiSpanFunc
+ascii_span_get (void)
+{
+  static gsize span = 0;
+
+  if (g_once_init_enter (&span))
+    {
+      AsciiSpanFunc func = ascii_span_scalar;
+#ifdef SEGMENT_SIMD
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("avx2"))
+        func = ascii_span_avx2;
+      else
+        func = ascii_span_sse2;
+#endif
+      g_once_init_leave (&span, (gsize) func);
+    }
+
+  return (AsciiSpanFunc) span;
+}
+
+static gboolean
+is_apostrophe (gunichar c)
+{
+  return c == '\'' || c == 8217;
+}
+
+static gboolean
+needs_dictionary (gunichar c)
+{
+  /* all of the scripts below start at U+0E00 or later */
+  if (c < 0x0E00)
+    return FALSE;
+
+  switch (g_unichar_get_script (c))
+    {
+    case G_UNICODE_SCRIPT_THAI:
+    case G_UNICODE_SCRIPT_LAO:
+    case G_UNICODE_SCRIPT_KHMER:
+    case G_UNICODE_SCRIPT_MYANMAR:
+    case G_UNICODE_SCRIPT_HAN:
+    case G_UNICODE_SCRIPT_HIRAGANA:
+    case G_UNICODE_SCRIPT_KATAKANA:
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+/* whether @c ends the run of text left to pango */
+static gboolean
+ends_fallback (gunichar c)
+{
+  GUnicodeScript script;
+
+  if (c < 0x80)
+    return g_ascii_isalpha (c) || c == '\n' || c == '\r';
+  if (c == 0x2029) /* paragraph separator */
+    return TRUE;
+  if (!g_unichar_isalpha (c) || needs_dictionary (c))
+    return FALSE;
+
+  /* like the prolonged sound mark of kana, which is common to scripts */
+  script = g_unichar_get_script (c);
+  return script != G_UNICODE_SCRIPT_COMMON && script != G_UNICODE_SCRIPT_INHERITED;
+}
+
+static gboolean
+is_word_char (gunichar c)
+{
+  if (c < 0x80)
+    return g_ascii_isalnum (c);
+  return g_unichar_isalnum (c) || g_unichar_ismark (c);
+}
+
+/* whether @c, between @prev and @next, belongs to the word */
+static gboolean
+joins_word (gunichar prev, gunichar c, gunichar next)
+{
+  if (is_apostrophe (c))
+    return g_unichar_isalpha (next);
+  if (c == '.')
+    return (g_unichar_isalpha (prev) && g_unichar_isalpha (next)) ||
+           (g_unichar_isdigit (prev) && g_unichar_isdigit (next));
+  if (c == ',')
+    return g_unichar_isdigit (prev) && g_unichar_isdigit (next);
+  if (c == '_')
+    return is_word_char (next);
+  return FALSE;
+}
+
+/* the pango fallback, which works with character positions relative to
+ * where it took over */
+
+static glong
+attrs_find_word_end (const PangoLogAttr *attrs, glong n_chars, glong pos)
+{
+  glong i;
+  for (i = pos + 1; i <= n_chars; i++)
+    if (attrs[i].is_word_end)
+      return i;
+  return pos;
+}
+
+static glong
+attrs_find_word_start (const PangoLogAttr *attrs, glong n_chars, glong pos)
+{
+  glong i;
+  for (i = pos; i < n_chars; i++)
+    if (attrs[i].is_word_start)
+      return i;
+  return n_chars;
+}
+
+/* the counterpart of gtk_spell_text_iter_forward_word_end */
+static glong
+text_forward_word_end (const PangoLogAttr *attrs, const gunichar *chars,
+                       glong n_chars, glong pos)
+{
+  glong end = attrs_find_word_end (attrs, n_chars, pos);
+
+  if (end == pos || end + 1 >= n_chars || !is_apostrophe (chars[end]))
+    return end;
+
+  if (g_unichar_isalpha (chars[end + 1]))
+    return attrs_find_word_end (attrs, n_chars, end);
+
+  return end;
+}
+
+/* the end of the run left to pango, which @p needing a dictionary starts
+ * or is part of.  a run of text without letters of other scripts or
+ * paragraph breaks is cut at the next character outside words past
+ * FALLBACK_MAX_CHARS, which bounds the arrays of the fallback, or anywhere
+ * past 16 times as many, even in a word. */
+#define FALLBACK_MAX_CHARS 4096
+
+static const gchar *
+fallback_run_end (const gchar *p, const gchar *text_end)
+{
+  gunichar c;
+  glong n;
+
+  for (n = 0; p < text_end; p = g_utf8_next_char (p), n++)
+    {
+      c = g_utf8_get_char (p);
+      if (ends_fallback (c) ||
+          (n >= FALLBACK_MAX_CHARS && !is_word_char (c)) ||
+          n >= 16 * FALLBACK_MAX_CHARS)
+        break;
+    }
+
+  return p;
+}
+
+/* leaves the text from @p at @offset to the run end of @trigger to pango */
+static void
+fallback_start (SegmentIter *iter, const gchar *p, glong offset,
+                const gchar *trigger)
+{
+  iter->base = p;
+  iter->base_offset = offset;
+  iter->base_end = fallback_run_end (trigger, iter->text_end);
+  iter->chars = g_utf8_to_ucs4_fast (p, iter->base_end - p, &iter->n_chars);
+  iter->attrs = g_new0 (PangoLogAttr, iter->n_chars + 1);
+  pango_get_log_attrs (p, iter->base_end - p, -1, pango_language_get_default (),
+                       iter->attrs, iter->n_chars + 1);
+  iter->pos = 0;
+  iter->q = p;
+  iter->q_pos = 0;
+}
+
+/* goes back to finding the words the usual way after the run */
+static void
+fallback_stop (SegmentIter *iter)
+{
+  iter->p = iter->base_end;
+  iter->offset = iter->base_offset + iter->n_chars;
+  segment_iter_clear (iter);
+}
+
+/* the byte offset of the character at @pos, which never moves backwards */
+static gsize
+fallback_byte_offset (SegmentIter *iter, glong pos)
+{
+  iter->q = g_utf8_offset_to_pointer (iter->q, pos - iter->q_pos);
+  iter->q_pos = pos;
+  return iter->q - iter->text;
+}
+
+static gboolean
+fallback_next (SegmentIter *iter, SegmentWord *word)
+{
+  glong start, end;
+
+  start = attrs_find_word_start (iter->attrs, iter->n_chars, iter->pos);
+  if (start >= iter->n_chars)
+    return FALSE;
+  end = text_forward_word_end (iter->attrs, iter->chars, iter->n_chars, start);
+  if (end == start)
+    return FALSE;
+  iter->pos = end;
+
+  word->start = iter->base_offset + start;
+  word->end = iter->base_offset + end;
+  word->byte_start = fallback_byte_offset (iter, start);
+  word->byte_end = fallback_byte_offset (iter, end);
+  return TRUE;
+}
+
+void
+segment_iter_init (SegmentIter *iter, const gchar *text, gssize length)
+{
+  if (length < 0)
+    length = strlen (text);
+
+  iter->text = text;
+  iter->text_end = text + length;
+  iter->p = text;
+  iter->offset = 0;
+  iter->attrs = NULL;
+  iter->chars = NULL;
+  iter->n_chars = 0;
+}
+
+/* finds the next word without pango.  returns FALSE at the end of the
+ * text, or when it has left a run of text to pango. */
+static gboolean
+native_next (SegmentIter *iter, SegmentWord *word)
+{
+  AsciiSpanFunc ascii_span = ascii_span_get ();
+  const gchar *p = iter->p, *start, *next;
+  glong offset = iter->offset, start_offset;
+  gunichar c = 0, prev;
+  gsize n;
+
+  /* skip to the start of the next word */
+  while (p < iter->text_end)
+    {
+      if ((guchar) *p < 0x80)
+        {
+          n = ascii_span (p, iter->text_end - p, FALSE);
+          p += n;
+          offset += n;
+          if (p >= iter->text_end)
+            break;
+          if ((guchar) *p < 0x80)
+            {
+              c = *p;
+              break;
+            }
+        }
+
+      c = g_utf8_get_char (p);
+      if (needs_dictionary (c))
+        {
+          fallback_start (iter, p, offset, p);
+          return FALSE;
+        }
+      if (is_word_char (c) && !g_unichar_ismark (c))
+        break;
+      p = g_utf8_next_char (p);
+      offset++;
+    }
+  if (p >= iter->text_end)
+    {
+      iter->p = p;
+      iter->offset = offset;
+      return FALSE;
+    }
+
+  /* and then to its end */
+  start = p;
+  start_offset = offset;
+  prev = c;
+  p = g_utf8_next_char (p);
+  offset++;
+  while (p < iter->text_end)
+    {
+      n = ascii_span (p, iter->text_end - p, TRUE);
+      if (n > 0)
+        {
+          p += n;
+          offset += n;
+          prev = (guchar) p[-1];
+          if (p >= iter->text_end)
+            break;
+        }
+
+      c = g_utf8_get_char (p);
+      if (needs_dictionary (c))
+        {
+          fallback_start (iter, start, start_offset, p);
+          return FALSE;
+        }
+      next = g_utf8_next_char (p);
+      /* a joining character is only taken along with the word character
+       * following it, which is taken on the next round */
+      if (is_word_char (c) ||
+          (next < iter->text_end && joins_word (prev, c, g_utf8_get_char (next))))
+        {
+          p = next;
+          offset++;
+          prev = c;
+        }
+      else
+        break;
+    }
+
+  iter->p = p;
+  iter->offset = offset;
+
+  word->start = start_offset;
+  word->end = offset;
+  word->byte_start = start - iter->text;
+  word->byte_end = p - iter->text;
+  return TRUE;
+}
+
+/* finds the next word, returns FALSE at the end of the text */
+gboolean
+segment_iter_next (SegmentIter *iter, SegmentWord *word)
+{
+  for (;;)
+    {
+      if (!iter->attrs)
+        {
+          if (native_next (iter, word))
+            return TRUE;
+          if (!iter->attrs)
+            return FALSE;
+        }
+      if (fallback_next (iter, word))
+        return TRUE;
+      fallback_stop (iter);
+    }
+}
+
+void
+segment_iter_clear (SegmentIter *iter)
+{
+  g_free (iter->attrs);
+  g_free (iter->chars);
+  iter->attrs = NULL;
+  iter->chars = NULL;
+}
@@ -0,0 +1,69 @@
+/* gtkspell - a spell-checking addon for GTK's TextView widget
+ * Copyright (c) 2002 Evan Martin
+ * Copyright (c) 2012-2013 Sandro Mani
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* vim: set ts=4 sw=4 wm=5 : */
+
+#ifndef GTK_SPELL_SEGMENT_H
+#define GTK_SPELL_SEGMENT_H
+
+#include <glib.h>
+#include <pango/pango.h>
+
+G_BEGIN_DECLS
+
+typedef struct _SegmentWord SegmentWord;
+struct _SegmentWord
+{
+  glong start;      /* character offsets */
+  glong end;
+  gsize byte_start;  /* byte offsets */
+  gsize byte_end;
+};
+
+/* walks the words of a piece of UTF-8 text, see gtkspell-segment.c */
+typedef struct _SegmentIter SegmentIter;
+struct _SegmentIter
+{
+  const gchar *text;
+  const gchar *text_end;
+  const gchar *p;
+  glong offset;
+
+  /* the pango fallback, while it has taken over a run of the text */
+  PangoLogAttr *attrs;
+  gunichar *chars;
+  glong n_chars;
+  const gchar *base;
+  const gchar *base_end;
+  glong base_offset;
+  glong pos;
+  const gchar *q;
+  glong q_pos;
+};
+
+void     segment_iter_init  (SegmentIter *iter,
+                             const gchar *text,
+                             gssize       length);
+gboolean segment_iter_next  (SegmentIter *iter,
+                             SegmentWord *word);
+void     segment_iter_clear (SegmentIter *iter);
+
+G_END_DECLS
+
+#endif /* GTK_SPELL_SEGMENT_H */
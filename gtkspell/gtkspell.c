@@ -21,7 +21,9 @@
 
 #include "../config.h"
 #include "gtkspell.h"
+#include "gtkspell-segment.h"
 #include <string.h>
+#include <glib/gstdio.h>
 #include <libintl.h>
 #include <locale.h>
 #include <enchant.h>
@@ -39,21 +41,173 @@
 #define GTK_SPELL_MISSPELLED_TAG "gtkspell-misspelled"
 #define GTK_SPELL_OBJECT_KEY "gtkspell"
 
+/* incremental rechecks process the buffer in chunks of RECHECK_CHUNK_LINES
+ * lines, for at most RECHECK_BUDGET_USEC per main loop iteration */
+#define RECHECK_CHUNK_LINES 16
+#define RECHECK_BUDGET_USEC 5000
+
+/* threaded checkers split synchronous rechecks of buffers with at least
+ * SHARD_MIN_CHARS characters into SHARDS_PER_PROCESSOR paragraph-aligned
+ * shards per processor, which are checked in parallel */
+#define SHARD_MIN_CHARS (1 << 20)
+#define SHARDS_PER_PROCESSOR 4
+
 static const int debug = 0;
 static const int quiet = 0;
 
+/* the broker outlives the last checker for a while, since loading the
+ * provider modules again is costly */
+#define BROKER_KEEP_ALIVE_SECONDS 30
+
 static EnchantBroker *broker = NULL;
 static int broker_ref_cnt = 0;
-#ifdef HAVE_ISO_CODES
-static int codetable_ref_cnt = 0;
-#endif
+static guint broker_release_source = 0;
+
+/* enchant verdicts are cached process-wide, in one table per language.
+ * A table lives as long as some checker uses its language, which is also
+ * how long the broker keeps the corresponding dictionary (and thus its
+ * session word list) loaded. */
+#define WORD_CACHE_MAX_WORDS 16384
+#define WORD_CORRECT GINT_TO_POINTER (1)
+#define WORD_MISSPELLED GINT_TO_POINTER (2)
+#define WORD_USED 4 /* flags the verdicts used since the last eviction */
+
+/* suggestions are cached in the same tables, for fewer words since they
+ * take a while to compute but are only looked at on request */
+#define SUGGESTION_CACHE_MAX_WORDS 256
+
+/* when the backend is too slow to suggest within a deadline, words close
+ * to the misspelled one are picked from the personal word list, the session
+ * and the replacements made recently instead */
+#define PERSONAL_WORDS_MAX 20000
+#define REPLACEMENTS_MAX 64
+#define FALLBACK_SUGGESTIONS_MAX 10
+#define SUGGESTION_MENU_DEADLINE_MS 50
+
+/* checkers prefetching suggestions do so for the misspelled words found
+ * within this many characters of the cursor, the most recent first */
+#define PREFETCH_DISTANCE_CHARS 2000
+#define PREFETCH_QUEUE_MAX 16
+
+/* the acceptance counts of a checker's languages are halved at this
+ * value, so that the order follows the text as it changes */
+#define SPELLER_ACCEPTED_MAX 4096
+
+/* checkers detecting the language of each paragraph try this many of its
+ * words with each of their languages, and remember the verdict for this
+ * many paragraphs */
+#define DETECT_SAMPLE_WORDS 16
+#define DETECT_WORD_MAX_BYTES 64
+#define DETECT_SAMPLE_BYTES 4096
+#define PARAGRAPH_LANGS_MAX 4096
+
+/* streams are read in chunks into a buffer of bounded size */
+#define STREAM_CHUNK_SIZE (64 * 1024)
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+
+/* dictionaries no checker uses are kept loaded within these limits, the
+ * size of one taken as a multiple of its word list's */
+#define DICT_WARM_MAX 4
+#define DICT_WARM_BUDGET (64 * 1024 * 1024)
+#define DICT_SIZE_FACTOR 4
+#define DICT_SIZE_UNKNOWN (8 * 1024 * 1024)
+
+typedef struct _WordCache WordCache;
+struct _WordCache
+{
+  gint ref_cnt;
+  gchar *lang;
+  GHashTable *words;
+  /* the rest is guarded by the word lists lock */
+  GHashTable *session; /* words added to the session, in all case forms */
+  GHashTable *suggestions; /* word -> NULL-terminated array of suggestions */
+  GHashTable *pending; /* words with a timed suggestion lookup in flight */
+  GPtrArray *personal; /* the personal word list, loaded on demand */
+  GQueue *replacements; /* Replacements, the most recent first */
+};
+
+/* one of the languages of a checker. a checker accepts a word if any of
+ * its languages does, asking the one that accepted the most words first. */
+typedef struct _Speller Speller;
+struct _Speller
+{
+  EnchantDict *dict;
+  WordCache *cache;
+  gchar *lang;
+  const gchar *tag; /* interned, names the speller across threads */
+  guint accepted;
+};
+
+typedef struct _Replacement Replacement;
+struct _Replacement
+{
+  gchar *word;
+  gchar *replacement;
+};
 
+/* a dictionary shared by the checkers using the same language */
+typedef struct _PooledDict PooledDict;
+struct _PooledDict
+{
+  gint ref_cnt;
+  EnchantDict *dict;
+  EnchantBroker *broker; /* the one the dictionary came from, if not the shared one */
+  GPtrArray *tags; /* the normalized tags the dictionary is pooled under */
+  gsize size; /* estimated */
+  GList *warm_link; /* set while no checker uses the dictionary */
+};
+
+static GHashTable *dict_pool = NULL; /* normalized tag -> PooledDict */
+static GHashTable *dict_pool_dicts = NULL; /* EnchantDict -> PooledDict */
+static GQueue dict_warm = G_QUEUE_INIT;
+static gsize dict_warm_size = 0;
+static guint dict_warm_max = DICT_WARM_MAX;
+static gsize dict_warm_budget = DICT_WARM_BUDGET;
+
+static GHashTable *word_caches = NULL;
+static guint word_cache_hits = 0;
+static guint word_cache_misses = 0;
+static guint word_cache_evictions = 0;
+
+static GThreadPool *shard_pool = NULL;
+
+/* guards the enchant dictionaries and the word caches, which the worker
+ * threads of threaded checkers use as well */
+G_LOCK_DEFINE_STATIC (speller);
+
+/* guards the suggestions and the word lists of the word caches, which the
+ * fallback suggestions are picked from.  held briefly only, never while
+ * the backend is asked, and taken after the speller lock when both are
+ * needed. */
+G_LOCK_DEFINE_STATIC (word_lists);
+
+/* guards the broker along with the language list, which is built in a
+ * worker thread as well. taken before the speller lock when both are
+ * needed. */
+G_LOCK_DEFINE_STATIC (broker);
+
+/* serializes the suggestion lookups with spare dictionaries, so that they
+ * take turns with one spare instance of a dictionary rather than load one
+ * each */
+G_LOCK_DEFINE_STATIC (suggest);
+
+static void gtk_spell_checker_constructed (GObject *object);
 static void gtk_spell_checker_dispose (GObject *object);
 static void gtk_spell_checker_finalize (GObject *object);
+static void prefetch_queue_word (GtkSpellChecker *spell, const GtkTextIter *iter,
+                                 const gchar *word);
+static void suggest_word_async (GtkSpellChecker *spell, const gchar *word,
+                                gboolean use_spare, GCancellable *cancellable,
+                                GAsyncReadyCallback callback, gpointer user_data);
+static void dict_pool_trim (guint max_dicts, gsize max_bytes);
+static void languages_preload_start (GtkSpellChecker *spell, GtkWidget *menu,
+                                     gchar **tags);
 
 enum
 {
   LANGUAGE_CHANGED,
+  CHECK_COMPLETE,
+  READY,
   LAST_SIGNAL
 };
 
@@ -62,7 +216,14 @@ static guint signals[LAST_SIGNAL] = { 0 };
 enum
 {
   PROP_0,
-  PROP_DECODE_LANGUAGE_CODES
+  PROP_DECODE_LANGUAGE_CODES,
+  PROP_INCREMENTAL,
+  PROP_PROGRESS,
+  PROP_THREADED,
+  PROP_PREFETCH_SUGGESTIONS,
+  PROP_PRELOAD_LANGUAGES,
+  PROP_DEFERRED_LOAD,
+  PROP_DETECT_LANGUAGE
 };
 
 #define GTK_SPELL_CHECKER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), GTK_SPELL_TYPE_CHECKER, GtkSpellCheckerPrivate))
@@ -75,8 +236,33 @@ struct _GtkSpellCheckerPrivate
   GtkTextMark *mark_insert_start;
   GtkTextMark *mark_insert_end;
   GtkTextMark *mark_click;
+  GtkTextMark *mark_recheck_top;
+  GtkTextMark *mark_recheck_bottom;
+  GHashTable *misspellings;
+  GSequence *misspelling_ranges;
+  GtkAdjustment *vadjustment;
   gboolean deferred_check;
-  EnchantDict *speller;
+  gboolean incremental;
+  guint recheck_source;
+  gdouble progress;
+  gboolean threaded;
+  GThreadPool *check_pool;
+  gboolean prefetch;
+  GQueue *prefetch_queue;
+  guint prefetch_source;
+  GCancellable *prefetch_cancellable;
+  gboolean preload;
+  GCancellable *preload_cancellable;
+  GQueue *check_jobs; /* the CheckJobs of edits in flight */
+  gboolean deferred_load;
+  gboolean ready;
+  guint language_serial; /* tells the latest language change */
+  GPtrArray *spellers; /* Spellers, the most accepting first */
+  gboolean detect;
+  GHashTable *paragraph_langs; /* detection sample -> Speller tag */
+  gchar *edit_sample;          /* of the paragraph being edited */
+  EnchantDict *speller; /* the first language's, new words go there */
+  WordCache *word_cache;
   gchar *lang;
   gboolean decode_codes;
 };
@@ -129,1167 +315,5619 @@ gtk_spell_text_iter_backward_word_start (GtkTextIter *i)
 #define gtk_text_iter_backward_word_start gtk_spell_text_iter_backward_word_start
 #define gtk_text_iter_forward_word_end gtk_spell_text_iter_forward_word_end
 
-static void
-check_word (GtkSpellChecker *spell, GtkTextIter *start, GtkTextIter *end)
+static WordCache*
+word_cache_ref (const gchar *lang)
 {
-  char *text;
-  text = gtk_text_buffer_get_text (spell->priv->buffer, start, end, FALSE);
-  if (debug)
-    g_print ("checking: %s\n", text);
-  if (g_unichar_isdigit (*text) == FALSE && /* don't check numbers */
-      enchant_dict_check (spell->priv->speller, text, strlen (text)) != 0)
-    gtk_text_buffer_apply_tag (spell->priv->buffer, spell->priv->tag_highlight, start, end);
-  g_free (text);
+  WordCache *cache;
+
+  if (!word_caches)
+    word_caches = g_hash_table_new (g_str_hash, g_str_equal);
+
+  cache = g_hash_table_lookup (word_caches, lang);
+  if (!cache)
+    {
+      cache = g_new0 (WordCache, 1);
+      cache->lang = g_strdup (lang);
+      cache->words = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            (GDestroyNotify) g_free, NULL);
+      cache->session = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              (GDestroyNotify) g_free, NULL);
+      cache->suggestions = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  (GDestroyNotify) g_free,
+                                                  (GDestroyNotify) g_strfreev);
+      cache->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              (GDestroyNotify) g_free, NULL);
+      cache->replacements = g_queue_new ();
+      g_hash_table_insert (word_caches, cache->lang, cache);
+    }
+  cache->ref_cnt++;
+
+  return cache;
 }
 
 static void
-print_iter (char *name, GtkTextIter *iter)
+replacement_free (Replacement *r)
 {
-  g_print ("%1s[%d%c%c%c] ", name, gtk_text_iter_get_offset (iter),
-           gtk_text_iter_starts_word (iter) ? 's' : ' ',
-           gtk_text_iter_inside_word (iter) ? 'i' : ' ',
-           gtk_text_iter_ends_word (iter) ? 'e' : ' ');
+  g_free (r->word);
+  g_free (r->replacement);
+  g_slice_free (Replacement, r);
 }
 
 static void
-check_range (GtkSpellChecker *spell, GtkTextIter start,
-             GtkTextIter end, gboolean force_all)
+word_cache_unref (WordCache *cache)
 {
-  g_return_if_fail (spell->priv->speller != NULL); /* for check_word */
-
-  /* we need to "split" on word boundaries.
-   * luckily, pango knows what "words" are
-   * so we don't have to figure it out. */
+  if (!cache || --cache->ref_cnt > 0)
+    return;
 
-  GtkTextIter wstart, wend, cursor, precursor;
-  gboolean inword, highlight;
-  if (debug)
+  g_hash_table_remove (word_caches, cache->lang);
+  if (g_hash_table_size (word_caches) == 0)
     {
-      g_print ("check_range: ");
-      print_iter ("s", &start);
-      print_iter ("e", &end);
-      g_print (" -> ");
+      g_hash_table_unref (word_caches);
+      word_caches = NULL;
     }
 
-  if (gtk_text_iter_inside_word (&end))
-    gtk_text_iter_forward_word_end (&end);
-  if (!gtk_text_iter_starts_word (&start))
-    {
-      if (gtk_text_iter_inside_word (&start) ||
-          gtk_text_iter_ends_word (&start))
-        {
-          gtk_text_iter_backward_word_start (&start);
-        }
-      else
-        {
-          /* if we're neither at the beginning nor inside a word,
-           * me must be in some spaces.
-           * skip forward to the beginning of the next word. */
-          //gtk_text_buffer_remove_tag (buffer, tag_highlight, &start, &end);
-          if (gtk_text_iter_forward_word_end (&start))
-            gtk_text_iter_backward_word_start (&start);
-        }
-    }
-  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &cursor,
-                                    gtk_text_buffer_get_insert (spell->priv->buffer));
+  g_hash_table_unref (cache->words);
+  g_hash_table_unref (cache->session);
+  g_hash_table_unref (cache->suggestions);
+  g_hash_table_unref (cache->pending);
+  if (cache->personal)
+    g_ptr_array_unref (cache->personal);
+  g_queue_free_full (cache->replacements, (GDestroyNotify) replacement_free);
+  g_free (cache->lang);
+  g_free (cache);
+}
 
-  precursor = cursor;
-  gtk_text_iter_backward_char (&precursor);
-  highlight = gtk_text_iter_has_tag (&cursor, spell->priv->tag_highlight) ||
-      gtk_text_iter_has_tag (&precursor, spell->priv->tag_highlight);
+/* enchant accepts a word added to the personal dictionary or to the
+ * session also in upper case and capitalized */
+static gchar **
+word_case_forms (const gchar *word)
+{
+  gchar **forms = g_new0 (gchar *, 4);
+  GString *title = g_string_new (NULL);
 
-  gtk_text_buffer_remove_tag (spell->priv->buffer, spell->priv->tag_highlight, &start, &end);
+  g_string_append_unichar (title, g_unichar_totitle (g_utf8_get_char (word)));
+  g_string_append (title, g_utf8_next_char (word));
 
-  /* Fix a corner case when replacement occurs at beginning of buffer:
-   * An iter at offset 0 seems to always be inside a word,
-   * even if it's not.  Possibly a pango bug.
-   */
-  if (gtk_text_iter_get_offset (&start) == 0)
-    {
-      gtk_text_iter_forward_word_end (&start);
-      gtk_text_iter_backward_word_start (&start);
-    }
+  forms[0] = g_strdup (word);
+  forms[1] = g_utf8_strup (word, -1);
+  forms[2] = g_string_free (title, FALSE);
+  return forms;
+}
 
-  if (debug)
-    {
-      print_iter ("s", &start);
-      print_iter ("e", &end);
-      g_print ("\n");
-    }
+/* Drops the cached verdicts which adding @word to the personal dictionary
+ * or to the session can change. */
+static void
+word_cache_invalidate (WordCache *cache, const gchar *word)
+{
+  gchar **forms;
+  gint i;
 
-  wstart = start;
-  while (gtk_text_iter_compare (&wstart, &end) < 0)
-    {
-      /* move wend to the end of the current word. */
-      wend = wstart;
-      gtk_text_iter_forward_word_end (&wend);
+  if (!cache || *word == 0)
+    return;
 
-      /* make sure we've actually advanced
-       * (we don't advance in some corner cases, such as after punctuation) */
-      if (gtk_text_iter_equal (&wstart, &wend))
-        break;
+  forms = word_case_forms (word);
+  for (i = 0; forms[i]; i++)
+    g_hash_table_remove (cache->words, forms[i]);
+  g_strfreev (forms);
 
-      inword = (gtk_text_iter_compare (&wstart, &cursor) < 0) &&
-               (gtk_text_iter_compare (&cursor, &wend) <= 0);
+  /* the new word may be suggested for any other */
+  G_LOCK (word_lists);
+  g_hash_table_remove_all (cache->suggestions);
+  G_UNLOCK (word_lists);
+}
 
-      if (inword && !force_all)
-        {
-          /* this word is being actively edited,
-           * only check if it's already highligted,
-           * otherwise defer this check until later. */
-          if (highlight)
-            check_word (spell, &wstart, &wend);
-          else
-            spell->priv->deferred_check = TRUE;
-        }
-      else
-        {
-          check_word (spell, &wstart, &wend);
-          spell->priv->deferred_check = FALSE;
-        }
+/* The dictionaries used by sharded rechecks have sessions of their own,
+ * so the words added to the session of the shared one are tracked here. */
+static void
+word_cache_add_session (WordCache *cache, const gchar *word)
+{
+  gchar **forms;
+  gint i;
 
-      /* now move wend to the beginning of the next word, */
-      gtk_text_iter_forward_word_end (&wend);
-      gtk_text_iter_backward_word_start (&wend);
-      /* make sure we've actually advanced
-       * (we don't advance in some corner cases), */
-      if (gtk_text_iter_equal (&wstart, &wend))
-        break; /* we're done in these cases.. */
-      /* and then pick this as the new next word beginning. */
-      wstart = wend;
-    }
+  if (!cache || *word == 0)
+    return;
+
+  forms = word_case_forms (word);
+  G_LOCK (word_lists);
+  for (i = 0; forms[i]; i++)
+    g_hash_table_add (cache->session, forms[i]);
+  G_UNLOCK (word_lists);
+  g_free (forms);
 }
 
+/* Keeps the loaded personal word list in step with the file. */
 static void
-check_deferred_range (GtkSpellChecker *spell, gboolean force_all)
+word_cache_add_personal (WordCache *cache, const gchar *word)
 {
-  GtkTextIter start, end;
-  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &start, spell->priv->mark_insert_start);
-  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &end, spell->priv->mark_insert_end);
-  check_range (spell, start, end, force_all);
+  G_LOCK (word_lists);
+  if (cache && cache->personal && cache->personal->len < PERSONAL_WORDS_MAX)
+    g_ptr_array_add (cache->personal, g_strdup (word));
+  G_UNLOCK (word_lists);
 }
 
-/* insertion works like this:
- *  - before the text is inserted, we mark the position in the buffer.
- *  - after the text is inserted, we see where our mark is and use that and
- *    the current position to check the entire range of inserted text.
- *
- * this may be overkill for the common case (inserting one character). */
-
+/* Loads the personal word list enchant keeps for the language, the
+ * fallback suggestions are picked from it. called with the word lists
+ * lock held. */
 static void
-insert_text_before (GtkTextBuffer *buffer, GtkTextIter *iter,
-                    gchar *text, gint len, GtkSpellChecker *spell)
+word_cache_load_personal (WordCache *cache)
 {
-  g_return_if_fail (buffer == spell->priv->buffer);
+  gchar *path, *name, *contents;
+  gchar **lines;
+  gint i;
 
-  gtk_text_buffer_move_mark (buffer, spell->priv->mark_insert_start, iter);
+  if (cache->personal)
+    return;
+  cache->personal = g_ptr_array_new_with_free_func (g_free);
+
+  name = g_strconcat (cache->lang, ".dic", NULL);
+  path = g_build_filename (g_get_user_config_dir (), "enchant", name, NULL);
+  if (g_file_get_contents (path, &contents, NULL, NULL))
+    {
+      lines = g_strsplit_set (contents, "\r\n", -1);
+      for (i = 0; lines[i] && cache->personal->len < PERSONAL_WORDS_MAX; i++)
+        if (*lines[i] && *lines[i] != '#' && g_utf8_validate (lines[i], -1, NULL))
+          g_ptr_array_add (cache->personal, g_strdup (lines[i]));
+      g_strfreev (lines);
+      g_free (contents);
+    }
+  g_free (path);
+  g_free (name);
 }
 
+/* Remembers that the user replaced @word with @replacement. */
 static void
-insert_text_after (GtkTextBuffer *buffer, GtkTextIter *iter,
-                   gchar *text, gint len, GtkSpellChecker *spell)
+word_cache_add_replacement (WordCache *cache, const gchar *word,
+                            const gchar *replacement)
 {
-  g_return_if_fail (buffer == spell->priv->buffer);
+  Replacement *r;
+  GList *l;
 
-  GtkTextIter start;
-
-  if (debug)
-    g_print ("insert\n");
+  if (!cache)
+    return;
 
-  /* we need to check a range of text. */
-  gtk_text_buffer_get_iter_at_mark (buffer, &start, spell->priv->mark_insert_start);
-  check_range (spell, start, *iter, FALSE);
+  G_LOCK (word_lists);
+  for (l = cache->replacements->head; l; l = l->next)
+    {
+      r = l->data;
+      if (strcmp (r->word, word) == 0 && strcmp (r->replacement, replacement) == 0)
+        {
+          g_queue_unlink (cache->replacements, l);
+          g_queue_push_head_link (cache->replacements, l);
+          G_UNLOCK (word_lists);
+          return;
+        }
+    }
 
-  gtk_text_buffer_move_mark (buffer, spell->priv->mark_insert_end, iter);
+  r = g_slice_new (Replacement);
+  r->word = g_strdup (word);
+  r->replacement = g_strdup (replacement);
+  g_queue_push_head (cache->replacements, r);
+  if (g_queue_get_length (cache->replacements) > REPLACEMENTS_MAX)
+    replacement_free (g_queue_pop_tail (cache->replacements));
+  G_UNLOCK (word_lists);
 }
 
-/* deleting is more simple:  we're given the range of deleted text.
- * after deletion, the start and end iters should be at the same position
- * (because all of the text between them was deleted!).
- * this means we only really check the words immediately bounding the
- * deletion.
- */
-
+/* moves the speller at @i up the order once it accepted more words than
+ * the one before it. called with the speller lock held. */
 static void
-delete_range_after (GtkTextBuffer *buffer, GtkTextIter *start,
-                    GtkTextIter *end, GtkSpellChecker *spell)
+speller_accepted (GPtrArray *spellers, guint i)
 {
-  g_return_if_fail (buffer == spell->priv->buffer);
+  Speller *sp = g_ptr_array_index (spellers, i);
+  guint j;
 
-  if (debug)
-    g_print ("delete\n");
-  check_range (spell, *start, *end, FALSE);
-}
+  if (spellers->len == 1)
+    return;
 
-static void
-mark_set (GtkTextBuffer *buffer, GtkTextIter *iter,
-          GtkTextMark *mark, GtkSpellChecker *spell)
-{
-  g_return_if_fail (buffer == spell->priv->buffer);
+  if (++sp->accepted >= SPELLER_ACCEPTED_MAX)
+    for (j = 0; j < spellers->len; j++)
+      ((Speller *) g_ptr_array_index (spellers, j))->accepted /= 2;
 
-  /* if the cursor has moved and there is a deferred check so handle it now */
-  if ((mark == gtk_text_buffer_get_insert (buffer)) && spell->priv->deferred_check)
-    check_deferred_range (spell, FALSE);
+  if (i > 0 && sp->accepted > ((Speller *) g_ptr_array_index (spellers, i - 1))->accepted)
+    {
+      g_ptr_array_index (spellers, i) = g_ptr_array_index (spellers, i - 1);
+      g_ptr_array_index (spellers, i - 1) = sp;
+    }
 }
 
+/* makes room in the full table of verdicts @words, like a clock: the
+ * verdicts not used since the last eviction are dropped and the others
+ * are marked unused, until a quarter of the table is free.  if too few
+ * were unused, a second round drops verdicts regardless. */
 static void
-get_word_extents_from_mark (GtkTextBuffer *buffer, GtkTextIter *start,
-                            GtkTextIter *end, GtkTextMark *mark)
+word_cache_evict (GHashTable *words)
 {
-  gtk_text_buffer_get_iter_at_mark (buffer, start, mark);
-  if (!gtk_text_iter_starts_word (start))
-    gtk_text_iter_backward_word_start (start);
-  *end = *start;
-  if (gtk_text_iter_inside_word (end))
-    gtk_text_iter_forward_word_end (end);
+  GHashTableIter iter;
+  gpointer verdict;
+  guint target = g_hash_table_size (words) / 4, evicted = 0;
+  gint round;
+
+  for (round = 0; round < 2 && evicted < target; round++)
+    {
+      g_hash_table_iter_init (&iter, words);
+      while (evicted < target && g_hash_table_iter_next (&iter, NULL, &verdict))
+        {
+          if (round == 0 && (GPOINTER_TO_INT (verdict) & WORD_USED))
+            g_hash_table_iter_replace (&iter, GINT_TO_POINTER (GPOINTER_TO_INT (verdict) & ~WORD_USED));
+          else
+            {
+              g_hash_table_iter_remove (&iter);
+              evicted++;
+            }
+        }
+    }
+
+  word_cache_evictions += evicted;
 }
 
-static void
-add_to_dictionary (GtkWidget *menuitem, GtkSpellChecker *spell)
+/* returns the verdict of @sp like enchant_dict_check does, remembering it.
+ * called with the speller lock held. */
+static int
+speller_check (Speller *sp, const gchar *word, gsize len)
 {
-  char *word;
-  GtkTextIter start, end;
+  GHashTable *words = sp->cache->words;
+  gpointer key, verdict;
+  gint flags;
+  int result;
 
-  get_word_extents_from_mark (spell->priv->buffer, &start, &end, spell->priv->mark_click);
-  word = gtk_text_buffer_get_text (spell->priv->buffer, &start, &end, FALSE);
+  if (g_hash_table_lookup_extended (words, word, &key, &verdict))
+    {
+      word_cache_hits++;
+      flags = GPOINTER_TO_INT (verdict);
+      if (!(flags & WORD_USED))
+        {
+          /* the table keeps the key */
+          g_hash_table_steal (words, key);
+          g_hash_table_insert (words, key, GINT_TO_POINTER (flags | WORD_USED));
+        }
+      return GINT_TO_POINTER (flags & ~WORD_USED) == WORD_CORRECT ? 0 : 1;
+    }
 
-  enchant_dict_add (spell->priv->speller, word, strlen (word));
+  word_cache_misses++;
+  result = enchant_dict_check (sp->dict, word, len);
 
-  gtk_spell_checker_recheck_all (spell);
+  /* don't remember backend errors */
+  if (result >= 0)
+    {
+      if (g_hash_table_size (words) >= WORD_CACHE_MAX_WORDS)
+        word_cache_evict (words);
+      g_hash_table_insert (words, g_strdup (word),
+                           result == 0 ? WORD_CORRECT : WORD_MISSPELLED);
+    }
 
-  g_free (word);
+  return result;
 }
 
-static void
-ignore_all (GtkWidget *menuitem, GtkSpellChecker *spell)
+/* word_is_correct, called with the speller lock held */
+static gboolean
+word_is_correct_locked (GtkSpellChecker *spell, const gchar *tag,
+                        const gchar *word, gsize len)
 {
-  char *word;
-  GtkTextIter start, end;
+  GPtrArray *spellers = spell->priv->spellers;
+  guint i;
+
+  if (tag && spellers)
+    for (i = 0; i < spellers->len; i++)
+      {
+        Speller *sp = g_ptr_array_index (spellers, i);
+        if (sp->tag == tag)
+          return speller_check (sp, word, len) == 0;
+      }
+
+  for (i = 0; spellers && i < spellers->len; i++)
+    {
+      if (speller_check (g_ptr_array_index (spellers, i), word, len) == 0)
+        {
+          speller_accepted (spellers, i);
+          return TRUE;
+        }
+    }
 
-  get_word_extents_from_mark (spell->priv->buffer, &start, &end, spell->priv->mark_click);
-  word = gtk_text_buffer_get_text (spell->priv->buffer, &start, &end, FALSE);
+  return FALSE;
+}
 
-  enchant_dict_add_to_session (spell->priv->speller, word, strlen (word));
+/* may be called from the worker threads.  @word has to be nul-terminated
+ * for the cache, @len saves enchant from measuring it again.  @tag names
+ * the language detected for the word's paragraph, or is NULL to accept
+ * the word in any of the checker's languages. */
+static gboolean
+word_is_correct (GtkSpellChecker *spell, const gchar *tag,
+                 const gchar *word, gsize len)
+{
+  gboolean correct;
 
-  gtk_spell_checker_recheck_all (spell);
+  G_LOCK (speller);
+  correct = word_is_correct_locked (spell, tag, word, len);
+  G_UNLOCK (speller);
 
-  g_free (word);
+  return correct;
 }
 
-static void
-replace_word (GtkWidget *menuitem, GtkSpellChecker *spell)
+/* the language of a paragraph is the one that accepts the most of its
+ * first words; the dictionaries serve as the language model. the verdict
+ * is remembered by those words, the sample, so it lasts until an edit
+ * changes them. */
+typedef int (*DetectCheckFunc) (gpointer data, guint i, const gchar *word, gsize len);
+
+/* the sample of the paragraph @text, its words separated by spaces, or
+ * NULL if it has none which tell anything.  only the first
+ * DETECT_SAMPLE_BYTES of the paragraph are looked at, which saves reading
+ * all of a long one. */
+static gchar *
+detect_sample (const gchar *text, gsize len)
 {
-  char *oldword;
-  const char *newword;
-  GtkTextIter start, end;
-
-  get_word_extents_from_mark (spell->priv->buffer, &start, &end, spell->priv->mark_click);
-  oldword = gtk_text_buffer_get_text (spell->priv->buffer, &start, &end, FALSE);
-  newword = gtk_label_get_text (GTK_LABEL (gtk_bin_get_child (GTK_BIN (menuitem))));
+  SegmentIter words;
+  SegmentWord word;
+  GString *sample;
+  guint sampled = 0;
 
-  if (debug)
+  if (len > DETECT_SAMPLE_BYTES)
     {
-      g_print ("old word: '%s'\n", oldword);
-      print_iter ("s", &start);
-      print_iter ("e", &end);
-      g_print ("\nnew word: '%s'\n", newword);
+      len = DETECT_SAMPLE_BYTES;
+      while (len > 0 && ((guchar) text[len] & 0xc0) == 0x80)
+        len--;
     }
 
-  gtk_text_buffer_begin_user_action (spell->priv->buffer);
-  gtk_text_buffer_delete (spell->priv->buffer, &start, &end);
-  gtk_text_buffer_insert (spell->priv->buffer, &start, newword, -1);
-  gtk_text_buffer_end_user_action (spell->priv->buffer);
+  sample = g_string_new (NULL);
+  segment_iter_init (&words, text, len);
+  while (sampled < DETECT_SAMPLE_WORDS && segment_iter_next (&words, &word))
+    {
+      gsize word_len = word.byte_end - word.byte_start;
 
-  enchant_dict_store_replacement (spell->priv->speller,
-                                  oldword, strlen (oldword),
-                                  newword, strlen (newword));
+      /* single letters and numbers tell nothing */
+      if (word.end - word.start < 2 || word_len > DETECT_WORD_MAX_BYTES ||
+          g_unichar_isdigit (g_utf8_get_char (text + word.byte_start)))
+        continue;
 
-  g_free (oldword);
+      if (sampled++ > 0)
+        g_string_append_c (sample, ' ');
+      g_string_append_len (sample, text + word.byte_start, word_len);
+    }
+  segment_iter_clear (&words);
+
+  return g_string_free (sample, sampled == 0);
 }
 
-/* This function populates suggestions at the top of the passed menu */
-static void
-add_suggestion_menus (GtkSpellChecker *spell, const char *word, GtkWidget *topmenu)
+/* returns the index of the language detected from @sample among
+ * @n_langs, or -1 */
+static gint
+detect_language (const gchar *sample, guint n_langs,
+                 DetectCheckFunc check, gpointer data)
 {
-  g_return_if_fail (spell->priv->speller != NULL);
+  gchar buf[DETECT_WORD_MAX_BYTES + 1];
+  const gchar *word, *end;
+  guint *scores;
+  gsize word_len;
+  gint best = -1;
+  guint i;
 
-  GtkWidget *menu;
-  GtkWidget *mi;
-  char **suggestions;
-  size_t n_suggs, i;
-  char *label;
+  scores = g_new0 (guint, n_langs);
 
-  menu = topmenu;
+  for (word = sample; word; word = *end ? end + 1 : NULL)
+    {
+      end = strchr (word, ' ');
+      if (!end)
+        end = word + strlen (word);
+      word_len = end - word;
+      memcpy (buf, word, word_len);
+      buf[word_len] = '\0';
+      for (i = 0; i < n_langs; i++)
+        if (check (data, i, buf, word_len) == 0)
+          scores[i]++;
+    }
 
-  gint menu_position = 0;
+  /* ties go to the language asked first */
+  for (i = 0; i < n_langs; i++)
+    if (scores[i] > 0 && (best < 0 || scores[i] > scores[best]))
+      best = i;
+  g_free (scores);
 
-  suggestions = enchant_dict_suggest (spell->priv->speller, word,
-                                      strlen (word), &n_suggs);
+  return best;
+}
 
-  if (suggestions == NULL || !n_suggs)
-    {
-      /* no suggestions.  put something in the menu anyway... */
-      GtkWidget *label;
-      label = gtk_label_new ("");
-      gtk_label_set_markup (GTK_LABEL (label), _("<i>(no suggestions)</i>"));
+static int
+detect_check_speller (gpointer data, guint i, const gchar *word, gsize len)
+{
+  GPtrArray *spellers = data;
 
-      mi = gtk_menu_item_new ();
-      gtk_container_add (GTK_CONTAINER (mi), label);
-      gtk_widget_show_all (mi);
-      gtk_menu_shell_insert (GTK_MENU_SHELL (menu), mi, menu_position++);
-    }
-  else
-    {
-      /* build a set of menus with suggestions. */
-      gboolean inside_more_submenu = FALSE;
-      for (i = 0; i < n_suggs; i++ )
-        {
-          if (i > 0 && i % 10 == 0)
-            {
-              inside_more_submenu = TRUE;
-              mi = gtk_menu_item_new_with_label (_("More..."));
-              gtk_widget_show (mi);
-              gtk_menu_shell_insert (GTK_MENU_SHELL (menu), mi, menu_position++);
+  return speller_check (g_ptr_array_index (spellers, i), word, len);
+}
 
-              menu = gtk_menu_new ();
-              gtk_menu_item_set_submenu (GTK_MENU_ITEM (mi), menu);
-            }
-          mi = gtk_menu_item_new_with_label (suggestions[i]);
-          g_signal_connect (mi, "activate", G_CALLBACK (replace_word), spell);
-          gtk_widget_show (mi);
-          if (inside_more_submenu)
-            gtk_menu_shell_append (GTK_MENU_SHELL (menu), mi);
-          else
-            gtk_menu_shell_insert (GTK_MENU_SHELL (menu), mi, menu_position++);
-        }
+/* called with the speller lock held. a paragraph without a sample has
+ * no language. */
+static gboolean
+paragraph_lang_lookup (GtkSpellChecker *spell, const gchar *sample,
+                       const gchar **tag)
+{
+  if (!sample)
+    {
+      *tag = NULL;
+      return TRUE;
     }
 
-  if (suggestions)
-    enchant_dict_free_string_list (spell->priv->speller, suggestions);
-
-  /* + Add to Dictionary */
-  label = g_strdup_printf (_("Add \"%s\" to Dictionary"), word);
-#if GTK_CHECK_VERSION(3,9,0)
-  mi = gtk_menu_item_new_with_label (label);
-#else
-  mi = gtk_image_menu_item_new_with_label (label);
-  gtk_image_menu_item_set_image (GTK_IMAGE_MENU_ITEM (mi),
-                 gtk_image_new_from_stock (GTK_STOCK_ADD, GTK_ICON_SIZE_MENU));
-#endif
-  g_free (label);
-  g_signal_connect (mi, "activate", G_CALLBACK (add_to_dictionary), spell);
-  gtk_widget_show_all (mi);
-  gtk_menu_shell_insert (GTK_MENU_SHELL (topmenu), mi, menu_position++);
-
-  /* - Ignore All */
-#if GTK_CHECK_VERSION(3,9,0)
-  mi = gtk_menu_item_new_with_label (_("Ignore All"));
-#else
-  mi = gtk_image_menu_item_new_with_label (_("Ignore All"));
-  gtk_image_menu_item_set_image (GTK_IMAGE_MENU_ITEM (mi),
-              gtk_image_new_from_stock (GTK_STOCK_REMOVE, GTK_ICON_SIZE_MENU));
-#endif
-  g_signal_connect (mi, "activate", G_CALLBACK (ignore_all), spell);
-  gtk_widget_show_all (mi);
-  gtk_menu_shell_insert (GTK_MENU_SHELL (topmenu), mi, menu_position++);
+  return g_hash_table_lookup_extended (spell->priv->paragraph_langs, sample,
+                                       NULL, (gpointer *) tag);
 }
 
-static GtkWidget*
-build_suggestion_menu (GtkSpellChecker *spell, const char *word)
+static void
+paragraph_lang_insert (GtkSpellChecker *spell, const gchar *sample,
+                       const gchar *tag)
 {
-  GtkWidget *topmenu;
-  topmenu = gtk_menu_new ();
-  add_suggestion_menus (spell, word, topmenu);
+  GHashTable *langs = spell->priv->paragraph_langs;
 
-  return topmenu;
+  if (g_hash_table_size (langs) >= PARAGRAPH_LANGS_MAX)
+    g_hash_table_remove_all (langs);
+  g_hash_table_insert (langs, g_strdup (sample), (gpointer) tag);
 }
 
-static void
-language_change_callback (GtkCheckMenuItem *mi, GtkSpellChecker* spell)
+/* returns the tag of the language detected from @sample, or NULL if the
+ * checker doesn't detect languages or none fits */
+static const gchar*
+sample_language (GtkSpellChecker *spell, const gchar *sample)
 {
-  if (gtk_check_menu_item_get_active (mi))
-    {
-      GError* error = NULL;
-      gchar *name;
-      g_object_get (G_OBJECT (mi), "name", &name, NULL);
-      gtk_spell_checker_set_language (spell, name, &error);
-      g_signal_emit (spell, signals[LANGUAGE_CHANGED], 0, spell->priv->lang);
-      g_free (name);
-    }
-}
+  GPtrArray *spellers;
+  const gchar *tag = NULL;
+  gint i;
 
-struct _languages_cb_struct { GList *langs; };
+  if (!spell->priv->detect || !sample)
+    return NULL;
 
-static void
-dict_describe_cb (const char * const lang_tag,
-                  const char * const provider_name,
-                  const char * const provider_desc,
-                  const char * const provider_file,
-                  void * user_data)
-{
-  struct _languages_cb_struct *languages_cb_struct = (struct _languages_cb_struct *)user_data;
+  G_LOCK (speller);
+  spellers = spell->priv->spellers;
+  if (spellers && spellers->len > 1 &&
+      !paragraph_lang_lookup (spell, sample, &tag))
+    {
+      i = detect_language (sample, spellers->len, detect_check_speller, spellers);
+      if (i >= 0)
+        tag = ((Speller *) g_ptr_array_index (spellers, i))->tag;
+      paragraph_lang_insert (spell, sample, tag);
+    }
+  G_UNLOCK (speller);
 
-  languages_cb_struct->langs = g_list_insert_sorted (
-      languages_cb_struct->langs, g_strdup (lang_tag),
-      (GCompareFunc) strcmp);
+  return tag;
 }
 
-static GtkWidget*
-build_languages_menu (GtkSpellChecker *spell)
+/* the language detected for the paragraph @text */
+static const gchar*
+paragraph_language (GtkSpellChecker *spell, const gchar *text, gsize len)
 {
-  GtkWidget *active_item = NULL, *menu = gtk_menu_new ();
-  GList *langs;
-  GtkWidget *mi;
-  GSList *menu_group = NULL;
-
-  struct _languages_cb_struct languages_cb_struct;
-  languages_cb_struct.langs = NULL;
+  const gchar *tag;
+  gchar *sample;
 
-  enchant_broker_list_dicts (broker, dict_describe_cb, &languages_cb_struct);
+  if (!spell->priv->detect)
+    return NULL;
 
-  langs = languages_cb_struct.langs;
+  sample = detect_sample (text, len);
+  tag = sample_language (spell, sample);
+  g_free (sample);
 
-  for (; langs; langs = langs->next)
-    {
-      gchar *lang_tag = langs->data;
-#ifdef HAVE_ISO_CODES
-      if (spell->priv->decode_codes == TRUE)
-        {
-          const gchar *lang_name = "\0";
-          const gchar *country_name = "\0";
-          gchar *label;
-          codetable_lookup (lang_tag, &lang_name, &country_name);
-          if (strlen (country_name) != 0)
-            label = g_strdup_printf ("%s (%s)", lang_name, country_name);
-          else
-            label = g_strdup_printf ("%s", lang_name);
-          mi = gtk_radio_menu_item_new_with_label (menu_group, label);
-          g_free (label);
-        }
-      else
-#endif
-        mi = gtk_radio_menu_item_new_with_label (menu_group, lang_tag);
-      menu_group = gtk_radio_menu_item_get_group (GTK_RADIO_MENU_ITEM (mi));
+  return tag;
+}
 
-      g_object_set (G_OBJECT (mi), "name", lang_tag, NULL);
-      if (spell->priv->lang && strcmp (spell->priv->lang, lang_tag) == 0)
-        active_item = mi;
-      gtk_widget_show (mi);
-      gtk_menu_shell_append (GTK_MENU_SHELL (menu), mi);
+/* the sample of the paragraph @iter is in, read from the buffer only as
+ * far as detect_sample looks */
+static gchar *
+paragraph_sample_at (GtkSpellChecker *spell, const GtkTextIter *iter)
+{
+  GtkTextIter start, end;
+  gchar *text, *sample;
 
-      g_free (lang_tag);
-    }
-  if (active_item)
-    gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (active_item), TRUE);
-  else
-    {
-      /* For the situation where no language is active (i.e.
-       * spell->priv->lang == NULL), create a "None" item which is active. */
-      mi = gtk_radio_menu_item_new_with_label (menu_group, _("None"));
-      gtk_menu_shell_append (GTK_MENU_SHELL (menu), mi);
-      gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (mi), TRUE);
-      gtk_widget_show (mi);
-    }
-  /* Connect signals to menu items after determining which one is active,
-   * since otherwise the signal is potentially already fired once (since the
-   * first item added to the group is active by default. */
-  for (; menu_group; menu_group = menu_group->next)
+  start = end = *iter;
+  gtk_text_iter_set_line_offset (&start, 0);
+  if (gtk_text_iter_get_chars_in_line (&start) > DETECT_SAMPLE_BYTES)
     {
-        mi = menu_group->data;
-        if (!gtk_check_menu_item_get_active (GTK_CHECK_MENU_ITEM (mi)))
-          g_signal_connect (mi, "activate",
-                            G_CALLBACK (language_change_callback), spell);
+      end = start;
+      gtk_text_iter_forward_chars (&end, DETECT_SAMPLE_BYTES);
     }
+  else if (!gtk_text_iter_ends_line (&end))
+    gtk_text_iter_forward_to_line_end (&end);
 
-  g_list_free (languages_cb_struct.langs);
+  text = gtk_text_buffer_get_slice (spell->priv->buffer, &start, &end, TRUE);
+  sample = detect_sample (text, strlen (text));
+  g_free (text);
 
-  return menu;
+  return sample;
 }
 
-static void
-populate_popup (GtkTextView *textview, GtkMenu *menu, GtkSpellChecker *spell)
+/* the language of the paragraph @iter is in */
+static const gchar*
+paragraph_language_at (GtkSpellChecker *spell, const GtkTextIter *iter)
 {
-  g_return_if_fail (spell->priv->view == textview);
+  const gchar *tag;
+  gchar *sample;
 
-  GtkWidget *mi;
-  GtkTextIter start, end;
-  char *word;
+  if (!spell->priv->detect)
+    return NULL;
 
-  /* menu separator comes first. */
-  mi = gtk_separator_menu_item_new ();
-  gtk_widget_show (mi);
-  gtk_menu_shell_prepend (GTK_MENU_SHELL (menu), mi);
+  sample = paragraph_sample_at (spell, iter);
+  tag = sample_language (spell, sample);
+  g_free (sample);
 
-  /* on top: language selection */
-  mi = gtk_menu_item_new_with_label (_("Languages"));
-  gtk_menu_item_set_submenu (GTK_MENU_ITEM (mi), build_languages_menu (spell));
-  gtk_widget_show_all (mi);
-  gtk_menu_shell_prepend (GTK_MENU_SHELL (menu), mi);
+  return tag;
+}
 
-  /* we need to figure out if they picked a misspelled word. */
-  get_word_extents_from_mark (spell->priv->buffer, &start, &end, spell->priv->mark_click);
+/* every highlighted word is recorded in an index from the word to the
+ * ranges it's highlighted at, so that adding a word to the dictionary (or
+ * ignoring it) only has to unhighlight its occurrences instead of checking
+ * the whole buffer again.  a range is a pair of marks, the start mark
+ * pointing back to its entry so that the entries in a part of the buffer
+ * can be found by walking the highlighted runs there.
+ *
+ * the entries are also kept in a sequence ordered by their position in the
+ * buffer, which answers the navigation queries.  the ranges never overlap,
+ * and edits can't make marks cross each other, so the order stays valid as
+ * the buffer changes. */
+#define MISSPELLING_KEY "gtkspell-misspelling"
+
+typedef struct _Misspelling Misspelling;
+struct _Misspelling
+{
+  GtkTextMark *start;
+  GtkTextMark *end;
+  gchar *word;
+  GList *link;
+  GSequenceIter *pos;
+  gint probe; /* offset searched for, in the entries used as search keys */
+};
 
-  /* if our highlight algorithm ever messes up,
-   * this isn't correct, either. */
-  if (!gtk_text_iter_has_tag (&start, spell->priv->tag_highlight))
-    return; /* word wasn't misspelled. */
+static gint
+misspelling_offset (GtkSpellChecker *spell, const Misspelling *m)
+{
+  GtkTextIter iter;
 
-  /* then, on top of it, the suggestions */
-  word = gtk_text_buffer_get_text (spell->priv->buffer, &start, &end, FALSE);
-  add_suggestion_menus (spell, word, GTK_WIDGET (menu));
-  g_free (word);
+  if (!m->start)
+    return m->probe;
+  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &iter, m->start);
+  return gtk_text_iter_get_offset (&iter);
 }
 
-/* when the user right-clicks on a word, they want to check that word.
- * here, we do NOT  move the cursor to the location of the clicked-upon word
- * since that prevents the use of edit functions on the context menu. */
-static gboolean
-button_press_event (GtkTextView *view, GdkEventButton *event, GtkSpellChecker *spell)
+static gint
+misspelling_compare (gconstpointer a, gconstpointer b, gpointer data)
 {
-  g_return_val_if_fail (spell->priv->view == view, FALSE);
-  g_return_val_if_fail (spell->priv->buffer == gtk_text_view_get_buffer (view), FALSE);
-
-  if (event->button == 3)
-    {
-      gint x, y;
-      GtkTextIter iter;
-
-      /* handle deferred check if it exists */
-      if (spell->priv->deferred_check)
-        check_deferred_range (spell, TRUE);
+  GtkSpellChecker *spell = data;
+  return misspelling_offset (spell, a) - misspelling_offset (spell, b);
+}
 
-      gtk_text_view_window_to_buffer_coords (view, GTK_TEXT_WINDOW_TEXT,
-                                             event->x, event->y, &x, &y);
-      gtk_text_view_get_iter_at_location (view, &iter, x, y);
-      gtk_text_buffer_move_mark (spell->priv->buffer, spell->priv->mark_click, &iter);
-    }
-  return FALSE; /* false: let gtk process this event, too.
-                 * we don't want to eat any events. */
+/* returns the first entry starting after @offset */
+static GSequenceIter *
+misspelling_search (GtkSpellChecker *spell, gint offset)
+{
+  Misspelling probe = { NULL, NULL, NULL, NULL, NULL, offset };
+  return g_sequence_search (spell->priv->misspelling_ranges, &probe,
+                            misspelling_compare, spell);
 }
 
-/* This event occurs when the popup menu is requested through a key-binding
- * (Menu Key or <shift>+F10 by default).  In this case we want to set
- * spell->priv->mark_click to the cursor position. */
+/* sets @start and @end to the range of the entry at @pos */
 static gboolean
-popup_menu_event (GtkTextView *view, GtkSpellChecker *spell)
+misspelling_get_range (GtkSpellChecker *spell, GSequenceIter *pos,
+                       GtkTextIter *start, GtkTextIter *end)
 {
-  g_return_val_if_fail (spell->priv->view == view, FALSE);
+  Misspelling *m;
 
-  GtkTextIter iter;
+  if (g_sequence_iter_is_end (pos))
+    return FALSE;
 
-  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &iter,
-                                   gtk_text_buffer_get_insert (spell->priv->buffer));
-  gtk_text_buffer_move_mark (spell->priv->buffer, spell->priv->mark_click, &iter);
-  return FALSE; /* false: let gtk process this event, too. */
+  m = g_sequence_get (pos);
+  if (start)
+    gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, start, m->start);
+  if (end)
+    gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, end, m->end);
+  return TRUE;
 }
 
 static void
-set_lang_from_dict (const char * const lang_tag,
-                    const char * const provider_name,
-                    const char * const provider_desc,
-                    const char * const provider_dll_file,
-                    void * user_data)
+misspelling_free (GtkSpellChecker *spell, Misspelling *m)
 {
-  GtkSpellChecker *spell = user_data;
+  GQueue *occurrences;
+
+  occurrences = g_hash_table_lookup (spell->priv->misspellings, m->word);
+  g_queue_delete_link (occurrences, m->link);
+  if (g_queue_is_empty (occurrences))
+    g_hash_table_remove (spell->priv->misspellings, m->word);
+  g_sequence_remove (m->pos);
+
+  g_object_set_data (G_OBJECT (m->start), MISSPELLING_KEY, NULL);
+  gtk_text_buffer_delete_mark (spell->priv->buffer, m->start);
+  gtk_text_buffer_delete_mark (spell->priv->buffer, m->end);
+  g_free (m->word);
+  g_slice_free (Misspelling, m);
+}
 
-  g_free (spell->priv->lang);
-  spell->priv->lang = g_strdup (lang_tag);
+static Misspelling *
+misspelling_at (const GtkTextIter *iter)
+{
+  Misspelling *m = NULL;
+  GSList *marks, *l;
+
+  marks = gtk_text_iter_get_marks (iter);
+  for (l = marks; l && !m; l = l->next)
+    m = g_object_get_data (G_OBJECT (l->data), MISSPELLING_KEY);
+  g_slist_free (marks);
+
+  return m;
 }
 
-static gboolean
-set_language_internal (GtkSpellChecker *spell, const gchar *lang, GError **error)
+/* highlights the misspelled @word between @start and @end */
+static void
+highlight_range (GtkSpellChecker *spell, const GtkTextIter *start,
+                 const GtkTextIter *end, const gchar *word)
 {
-  EnchantDict *dict;
+  GtkTextBuffer *buffer = spell->priv->buffer;
+  GQueue *occurrences;
+  Misspelling *m;
 
-  if (lang == NULL)
+  gtk_text_buffer_apply_tag (buffer, spell->priv->tag_highlight, start, end);
+
+  if ((m = misspelling_at (start)))
     {
-      lang = g_getenv ("LANG");
-      if (lang)
-        {
-          if ((strcmp (lang, "C") == 0) || (strcmp (lang, "c") == 0))
-            lang = NULL;
-          else if (lang[0] == 0)
-            lang = NULL;
-        }
+      GtkTextIter mend;
+      gtk_text_buffer_get_iter_at_mark (buffer, &mend, m->end);
+      if (gtk_text_iter_equal (&mend, end) && strcmp (m->word, word) == 0)
+        return;
+      misspelling_free (spell, m);
     }
 
-  if (!lang)
-    lang = "en";
+  occurrences = g_hash_table_lookup (spell->priv->misspellings, word);
+  if (!occurrences)
+    {
+      occurrences = g_queue_new ();
+      g_hash_table_insert (spell->priv->misspellings, g_strdup (word), occurrences);
+    }
 
-  dict = enchant_broker_request_dict (broker, lang);
+  m = g_slice_new (Misspelling);
+  m->start = gtk_text_buffer_create_mark (buffer, NULL, start, FALSE);
+  m->end = gtk_text_buffer_create_mark (buffer, NULL, end, TRUE);
+  m->word = g_strdup (word);
+  g_queue_push_tail (occurrences, m);
+  m->link = g_queue_peek_tail_link (occurrences);
+  m->pos = g_sequence_insert_sorted (spell->priv->misspelling_ranges, m,
+                                     misspelling_compare, spell);
+  g_object_set_data (G_OBJECT (m->start), MISSPELLING_KEY, m);
+
+  if (spell->priv->prefetch)
+    prefetch_queue_word (spell, start, word);
+}
 
-  if (!dict)
+/* drops the index entries of the highlighted runs overlapping the range.
+ * if @contained is set only the entries lying entirely inside the range are
+ * dropped, otherwise the range is grown to cover all the entries dropped. */
+static void
+unindex_range (GtkSpellChecker *spell, GtkTextIter *start,
+               GtkTextIter *end, gboolean contained)
+{
+  GtkTextTag *tag = spell->priv->tag_highlight;
+  GtkTextIter iter, mstart, mend;
+  Misspelling *m;
+
+  iter = *start;
+  /* an entry may begin before the range and reach into it */
+  if (gtk_text_iter_has_tag (&iter, tag) && !gtk_text_iter_begins_tag (&iter, tag))
+    gtk_text_iter_backward_to_tag_toggle (&iter, tag);
+  else if (!gtk_text_iter_has_tag (&iter, tag))
+    gtk_text_iter_forward_to_tag_toggle (&iter, tag);
+
+  /* entries start where a run does, or where the entry before them ends,
+   * so the marks are only looked up there */
+  while (gtk_text_iter_compare (&iter, end) < 0)
     {
-      g_set_error (error, GTK_SPELL_ERROR, GTK_SPELL_ERROR_BACKEND,
-                   _("enchant error for language: %s"), lang);
-      return FALSE;
-    }
+      if (!gtk_text_iter_has_tag (&iter, tag))
+        {
+          /* between the runs, skip to the start of the next one */
+          if (!gtk_text_iter_forward_to_tag_toggle (&iter, tag))
+            break;
+          continue;
+        }
 
-  if (spell->priv->speller)
-    enchant_broker_free_dict (broker, spell->priv->speller);
-  spell->priv->speller = dict;
+      if (!(m = misspelling_at (&iter)))
+        {
+          /* no entry starts here, skip to the end of the run */
+          if (!gtk_text_iter_forward_to_tag_toggle (&iter, tag))
+            break;
+          continue;
+        }
 
-  enchant_dict_describe (dict, set_lang_from_dict, spell);
+      gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &mstart, m->start);
+      gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &mend, m->end);
+      if (contained)
+        {
+          if (gtk_text_iter_compare (&mstart, start) >= 0 &&
+              gtk_text_iter_compare (&mend, end) <= 0)
+            misspelling_free (spell, m);
+        }
+      else if (gtk_text_iter_compare (&mend, start) > 0 ||
+               gtk_text_iter_compare (&mstart, start) >= 0)
+        {
+          if (gtk_text_iter_compare (&mstart, start) < 0)
+            *start = mstart;
+          if (gtk_text_iter_compare (&mend, end) > 0)
+            *end = mend;
+          misspelling_free (spell, m);
+        }
 
-  return TRUE;
+      /* the entry may span several runs, if text was inserted into it */
+      if (gtk_text_iter_compare (&mend, &iter) > 0)
+        iter = mend;
+      else if (!gtk_text_iter_forward_to_tag_toggle (&iter, tag))
+        break;
+    }
 }
 
-/* changes the buffer
- * a NULL buffer is acceptable and will only release the current one */
+/* removes the highlighting from a range, growing it to cover the whole of
+ * the misspelled words overlapping it */
 static void
-set_buffer (GtkSpellChecker *spell, GtkTextBuffer *buffer)
+unhighlight_range (GtkSpellChecker *spell, GtkTextIter *start, GtkTextIter *end)
 {
-  GtkTextIter start, end;
-
-  if (spell->priv->buffer)
-    {
-      g_signal_handlers_disconnect_matched (spell->priv->buffer, G_SIGNAL_MATCH_DATA,
-                                            0, 0, NULL, NULL, spell);
+  unindex_range (spell, start, end, FALSE);
+  gtk_text_buffer_remove_tag (spell->priv->buffer, spell->priv->tag_highlight, start, end);
+}
 
-      gtk_text_buffer_get_bounds (spell->priv->buffer, &start, &end);
-      gtk_text_buffer_remove_tag (spell->priv->buffer, spell->priv->tag_highlight,
-                                  &start, &end);
-      spell->priv->tag_highlight = NULL;
+/* removes the highlighting from all the occurrences of @word
+ * (in the case forms the dictionary accepts along with it) */
+static void
+unhighlight_word (GtkSpellChecker *spell, const gchar *word)
+{
+  GtkTextIter start, end;
+  GQueue *occurrences;
+  Misspelling *m;
+  gchar **forms;
+  gint i;
 
-      gtk_text_buffer_delete_mark (spell->priv->buffer, spell->priv->mark_insert_start);
-      spell->priv->mark_insert_start = NULL;
-      gtk_text_buffer_delete_mark (spell->priv->buffer, spell->priv->mark_insert_end);
-      spell->priv->mark_insert_end = NULL;
-      gtk_text_buffer_delete_mark (spell->priv->buffer, spell->priv->mark_click);
-      spell->priv->mark_click = NULL;
+  if (!spell->priv->buffer)
+    return;
 
-      g_object_unref (spell->priv->buffer);
+  forms = word_case_forms (word);
+  for (i = 0; forms[i]; i++)
+    {
+      while ((occurrences = g_hash_table_lookup (spell->priv->misspellings, forms[i])))
+        {
+          m = g_queue_peek_head (occurrences);
+          gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &start, m->start);
+          gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &end, m->end);
+          gtk_text_buffer_remove_tag (spell->priv->buffer, spell->priv->tag_highlight,
+                                      &start, &end);
+          misspelling_free (spell, m);
+        }
     }
+  g_strfreev (forms);
+}
 
-  spell->priv->buffer = buffer;
+/* drops the whole index, e.g. when the buffer is released */
+static void
+misspellings_clear (GtkSpellChecker *spell)
+{
+  GHashTableIter iter;
+  gpointer occurrences;
+
+  g_hash_table_iter_init (&iter, spell->priv->misspellings);
+  while (g_hash_table_iter_next (&iter, NULL, &occurrences))
+    {
+      Misspelling *m;
+      while ((m = g_queue_pop_head (occurrences)))
+        {
+          g_object_set_data (G_OBJECT (m->start), MISSPELLING_KEY, NULL);
+          gtk_text_buffer_delete_mark (spell->priv->buffer, m->start);
+          gtk_text_buffer_delete_mark (spell->priv->buffer, m->end);
+          g_free (m->word);
+          g_slice_free (Misspelling, m);
+        }
+      g_hash_table_iter_remove (&iter);
+    }
+  g_sequence_remove_range (g_sequence_get_begin_iter (spell->priv->misspelling_ranges),
+                           g_sequence_get_end_iter (spell->priv->misspelling_ranges));
+}
+
+/* checks the word between @start and @end, whose text is the @len bytes
+ * at @text.  the text belongs to the caller's copy of the range, which is
+ * nul-terminated in place for the duration of the check. */
+static void
+check_word (GtkSpellChecker *spell, const gchar *tag, GtkTextIter *start,
+            GtkTextIter *end, gchar *text, gsize len)
+{
+  gchar saved = text[len];
+
+  text[len] = '\0';
+  if (debug)
+    g_print ("checking: %s\n", text);
+  if (g_unichar_isdigit (*text) == FALSE && /* don't check numbers */
+      !word_is_correct (spell, tag, text, len))
+    highlight_range (spell, start, end, text);
+  text[len] = saved;
+}
+
+static void
+print_iter (char *name, GtkTextIter *iter)
+{
+  g_print ("%1s[%d%c%c%c] ", name, gtk_text_iter_get_offset (iter),
+           gtk_text_iter_starts_word (iter) ? 's' : ' ',
+           gtk_text_iter_inside_word (iter) ? 'i' : ' ',
+           gtk_text_iter_ends_word (iter) ? 'e' : ' ');
+}
+
+/* extends a range to the word boundaries around it */
+static void
+align_range (GtkTextIter *start, GtkTextIter *end)
+{
+  /* we need to "split" on word boundaries.
+   * luckily, pango knows what "words" are
+   * so we don't have to figure it out. */
+
+  if (debug)
+    {
+      g_print ("check_range: ");
+      print_iter ("s", start);
+      print_iter ("e", end);
+      g_print (" -> ");
+    }
+
+  if (gtk_text_iter_inside_word (end))
+    gtk_text_iter_forward_word_end (end);
+  if (!gtk_text_iter_starts_word (start))
+    {
+      if (gtk_text_iter_inside_word (start) ||
+          gtk_text_iter_ends_word (start))
+        {
+          gtk_text_iter_backward_word_start (start);
+        }
+      else
+        {
+          /* if we're neither at the beginning nor inside a word,
+           * me must be in some spaces.
+           * skip forward to the beginning of the next word. */
+          if (gtk_text_iter_forward_word_end (start))
+            gtk_text_iter_backward_word_start (start);
+        }
+    }
+
+  /* Fix a corner case when replacement occurs at beginning of buffer:
+   * An iter at offset 0 seems to always be inside a word,
+   * even if it's not.  Possibly a pango bug.
+   */
+  if (gtk_text_iter_get_offset (start) == 0)
+    {
+      gtk_text_iter_forward_word_end (start);
+      gtk_text_iter_backward_word_start (start);
+    }
+
+  if (debug)
+    {
+      print_iter ("s", start);
+      print_iter ("e", end);
+      g_print ("\n");
+    }
+}
+
+/* whether the word at the cursor is highlighted */
+static gboolean
+cursor_highlighted (GtkSpellChecker *spell, GtkTextIter *cursor)
+{
+  GtkTextIter precursor;
+
+  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, cursor,
+                                    gtk_text_buffer_get_insert (spell->priv->buffer));
+
+  precursor = *cursor;
+  gtk_text_iter_backward_char (&precursor);
+  return gtk_text_iter_has_tag (cursor, spell->priv->tag_highlight) ||
+      gtk_text_iter_has_tag (&precursor, spell->priv->tag_highlight);
+}
+
+static void
+check_range (GtkSpellChecker *spell, GtkTextIter start,
+             GtkTextIter end, gboolean force_all)
+{
+  g_return_if_fail (spell->priv->speller != NULL); /* for check_word */
+
+  GtkTextIter wstart, wend, cursor;
+  gboolean inword, highlight;
+  SegmentIter words;
+  SegmentWord word;
+  gchar *text;
+  gint cursor_offset, offset = 0;
+  gint line = -1;
+  const gchar *tag = NULL;
+
+  align_range (&start, &end);
+  highlight = cursor_highlighted (spell, &cursor);
+
+  unhighlight_range (spell, &start, &end);
+
+  /* the words are found within a single copy of the range, the slice
+   * keeps the character offsets in step with the iters */
+  text = gtk_text_buffer_get_slice (spell->priv->buffer, &start, &end, TRUE);
+  cursor_offset = gtk_text_iter_get_offset (&cursor) - gtk_text_iter_get_offset (&start);
+
+  wend = start;
+  segment_iter_init (&words, text, -1);
+  while (segment_iter_next (&words, &word))
+    {
+      wstart = wend;
+      gtk_text_iter_forward_chars (&wstart, word.start - offset);
+      wend = wstart;
+      gtk_text_iter_forward_chars (&wend, word.end - word.start);
+      offset = word.end;
+
+      if (spell->priv->detect && gtk_text_iter_get_line (&wstart) != line)
+        {
+          line = gtk_text_iter_get_line (&wstart);
+          tag = paragraph_language_at (spell, &wstart);
+        }
+
+      inword = (word.start < cursor_offset) && (cursor_offset <= word.end);
+
+      if (inword && !force_all)
+        {
+          /* this word is being actively edited,
+           * only check if it's already highligted,
+           * otherwise defer this check until later. */
+          if (highlight)
+            check_word (spell, tag, &wstart, &wend, text + word.byte_start,
+                        word.byte_end - word.byte_start);
+          else
+            spell->priv->deferred_check = TRUE;
+        }
+      else
+        {
+          check_word (spell, tag, &wstart, &wend, text + word.byte_start,
+                      word.byte_end - word.byte_start);
+          spell->priv->deferred_check = FALSE;
+        }
+    }
+  segment_iter_clear (&words);
+
+  g_free (text);
+}
+
+/* threaded checkers hand edited ranges to a worker thread as a CheckJob:
+ * the text of the range is copied and checked off the main thread, and the
+ * misspelled words found are highlighted back on the main thread, provided
+ * that neither the range nor the dictionary changed in the meantime.
+ * otherwise the range, which is tracked by a pair of marks, is checked
+ * again, by the job of the edit that changed it if there is one.
+ *
+ * the shards of a sharded recheck are CheckJobs as well, run in parallel
+ * from shard_pool. each shard borrows spare dictionaries, since enchant
+ * dictionaries must not be used concurrently. */
+typedef struct _ShardSet ShardSet;
+struct _ShardSet
+{
+  gchar **langs; /* in the order the checker asks them */
+  gboolean detect;
+  GHashTable *session;
+  GMutex lock;
+  GCond cond;
+  guint pending;
+};
+
+/* spare instances of the dictionaries, for the threads which must not wait
+ * for the shared ones.  a broker hands out a single instance of each
+ * dictionary, so every spare comes with a broker of its own.  a thread
+ * borrows spares exclusively and returns them when done; the idle ones,
+ * up to one per processor and language, live as long as the dictionary
+ * pool. */
+typedef struct _SpareDict SpareDict;
+struct _SpareDict
+{
+  EnchantBroker *broker;
+  EnchantDict *dict;
+  const gchar *tag; /* interned */
+};
+
+static GHashTable *spare_dicts = NULL; /* tag -> GSList of idle SpareDicts */
+
+/* guards spare_dicts, never held while a dictionary loads */
+G_LOCK_DEFINE_STATIC (spares);
+
+static void
+spare_dict_free (SpareDict *spare)
+{
+  enchant_broker_free_dict (spare->broker, spare->dict);
+  enchant_broker_free (spare->broker);
+  g_slice_free (SpareDict, spare);
+}
+
+/* borrows an instance of the dictionary for @tag, loading one if none is
+ * idle.  returns NULL if the dictionary fails to load. */
+static SpareDict *
+spare_dict_take (const gchar *tag)
+{
+  SpareDict *spare = NULL;
+  GSList *idle = NULL;
+
+  tag = g_intern_string (tag);
+
+  G_LOCK (spares);
+  if (spare_dicts)
+    idle = g_hash_table_lookup (spare_dicts, tag);
+  if (idle)
+    {
+      spare = idle->data;
+      g_hash_table_insert (spare_dicts, (gpointer) tag,
+                           g_slist_delete_link (idle, idle));
+    }
+  G_UNLOCK (spares);
+
+  if (spare)
+    return spare;
+
+  spare = g_slice_new (SpareDict);
+  spare->broker = enchant_broker_init ();
+  spare->dict = enchant_broker_request_dict (spare->broker, tag);
+  spare->tag = tag;
+  if (!spare->dict)
+    {
+      enchant_broker_free (spare->broker);
+      g_slice_free (SpareDict, spare);
+      return NULL;
+    }
+
+  return spare;
+}
+
+static void
+spare_dict_return (SpareDict *spare)
+{
+  GSList *idle;
+
+  G_LOCK (spares);
+  if (!spare_dicts)
+    spare_dicts = g_hash_table_new (NULL, NULL);
+  idle = g_hash_table_lookup (spare_dicts, spare->tag);
+  if (g_slist_length (idle) < g_get_num_processors ())
+    {
+      g_hash_table_insert (spare_dicts, (gpointer) spare->tag,
+                           g_slist_prepend (idle, spare));
+      spare = NULL;
+    }
+  G_UNLOCK (spares);
+
+  if (spare)
+    spare_dict_free (spare);
+}
+
+/* drops the idle spares, along with the last pooled dictionary */
+static void
+spare_dicts_free (void)
+{
+  GHashTable *table;
+  GHashTableIter iter;
+  gpointer idle;
+
+  G_LOCK (spares);
+  table = spare_dicts;
+  spare_dicts = NULL;
+  G_UNLOCK (spares);
+
+  if (!table)
+    return;
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, NULL, &idle))
+    g_slist_free_full (idle, (GDestroyNotify) spare_dict_free);
+  g_hash_table_unref (table);
+}
+
+/* borrows a spare of each of @langs, or returns NULL if one of them fails
+ * to load */
+static GPtrArray *
+shard_spares_take (gchar **langs)
+{
+  GPtrArray *spares = g_ptr_array_new_with_free_func ((GDestroyNotify) spare_dict_return);
+  SpareDict *spare;
+  guint i;
+
+  for (i = 0; langs[i]; i++)
+    {
+      if (!(spare = spare_dict_take (langs[i])))
+        {
+          g_ptr_array_unref (spares);
+          return NULL;
+        }
+      g_ptr_array_add (spares, spare);
+    }
+
+  return spares;
+}
+
+#define SHARD_DICT(job, i) (((SpareDict *) g_ptr_array_index ((job)->spares, (i)))->dict)
+
+typedef struct _CheckJob CheckJob;
+struct _CheckJob
+{
+  GtkSpellChecker *spell;
+  GtkTextBuffer *buffer;
+  GtkTextMark *mark_start;
+  GtkTextMark *mark_end;
+  GList *link;         /* in the checker's check_jobs */
+  gboolean dirty;      /* the range or the dictionary changed meanwhile */
+  gboolean superseded; /* a later job covers the range */
+  gchar *text;
+  gboolean force_all;
+  gint cursor;         /* character offset relative to the range */
+  gboolean highlight;
+  GArray *misspelled;  /* start/end character offsets relative to the range */
+  gint deferred_check; /* -1 if the check did not decide */
+  ShardSet *shards;    /* for the shards of a sharded recheck */
+  GPtrArray *spares;   /* the SpareDicts the shard borrowed, or NULL */
+  GHashTable *verdicts;
+  GPtrArray *lang_verdicts; /* the verdicts of each of the shard's languages */
+  gchar *context;      /* the whole lines of the range, to detect their languages */
+  gint context_offset; /* of the range in the context, in characters */
+  GArray *paragraphs;  /* Paragraphs, if the checker detects languages */
+  guint paragraph;     /* the one of the word being checked */
+};
+
+/* the language of a paragraph starting at a character offset relative to
+ * the range of a job */
+typedef struct _Paragraph Paragraph;
+struct _Paragraph
+{
+  gint start;
+  const gchar *tag;
+};
+
+static void check_job_run (gpointer data, gpointer user_data);
+
+static void
+check_job_free (CheckJob *job)
+{
+  if (job->link)
+    g_queue_delete_link (job->spell->priv->check_jobs, job->link);
+  gtk_text_buffer_delete_mark (job->buffer, job->mark_start);
+  gtk_text_buffer_delete_mark (job->buffer, job->mark_end);
+  g_object_unref (job->buffer);
+  g_object_unref (job->spell);
+  g_free (job->text);
+  g_free (job->context);
+  g_array_free (job->misspelled, TRUE);
+  if (job->paragraphs)
+    g_array_free (job->paragraphs, TRUE);
+  g_free (job);
+}
+
+static CheckJob *
+check_job_new (GtkSpellChecker *spell, GtkTextIter start,
+               GtkTextIter end, gboolean force_all)
+{
+  GtkTextBuffer *buffer = spell->priv->buffer;
+  GtkTextIter cursor;
+  CheckJob *job;
+
+  align_range (&start, &end);
+
+  job = g_new0 (CheckJob, 1);
+  job->spell = g_object_ref (spell);
+  job->buffer = g_object_ref (buffer);
+  job->mark_start = gtk_text_buffer_create_mark (buffer, NULL, &start, TRUE);
+  job->mark_end = gtk_text_buffer_create_mark (buffer, NULL, &end, FALSE);
+  /* unlike the text, the slice keeps character offsets intact */
+  job->text = gtk_text_buffer_get_slice (buffer, &start, &end, TRUE);
+  job->force_all = force_all;
+  job->highlight = cursor_highlighted (spell, &cursor);
+  job->cursor = gtk_text_iter_get_offset (&cursor) - gtk_text_iter_get_offset (&start);
+  job->misspelled = g_array_new (FALSE, FALSE, sizeof (gint));
+  job->deferred_check = -1;
+
+  return job;
+}
+
+/* marks the jobs in flight whose range touches the one between @start and
+ * @end as dirty, or all of them if @start is NULL (when the dictionary
+ * changed).  the results of the other jobs are still valid, since their
+ * offsets are relative to their own start. */
+static void
+check_jobs_invalidate (GtkSpellChecker *spell, const GtkTextIter *start,
+                       const GtkTextIter *end)
+{
+  GtkTextIter jstart, jend;
+  CheckJob *job;
+  GList *l;
+
+  for (l = spell->priv->check_jobs->head; l; l = l->next)
+    {
+      job = l->data;
+      if (start && job->buffer == spell->priv->buffer)
+        {
+          gtk_text_buffer_get_iter_at_mark (job->buffer, &jstart, job->mark_start);
+          gtk_text_buffer_get_iter_at_mark (job->buffer, &jend, job->mark_end);
+          if (gtk_text_iter_compare (start, &jend) > 0 ||
+              gtk_text_iter_compare (end, &jstart) < 0)
+            continue;
+        }
+      job->dirty = TRUE;
+    }
+}
+
+static void
+queue_check_range (GtkSpellChecker *spell, GtkTextIter start,
+                   GtkTextIter end, gboolean force_all)
+{
+  g_return_if_fail (spell->priv->speller != NULL);
+
+  GtkTextIter jstart, jend;
+  CheckJob *job;
+  GList *l;
+
+  /* the new job takes over the ranges of the dirty jobs it touches, so
+   * that typing keeps a single job in flight rather than requeueing one
+   * more with every key */
+  for (l = spell->priv->check_jobs->head; l; l = l->next)
+    {
+      job = l->data;
+      if (!job->dirty || job->superseded || job->buffer != spell->priv->buffer)
+        continue;
+      gtk_text_buffer_get_iter_at_mark (job->buffer, &jstart, job->mark_start);
+      gtk_text_buffer_get_iter_at_mark (job->buffer, &jend, job->mark_end);
+      if (gtk_text_iter_compare (&start, &jend) > 0 ||
+          gtk_text_iter_compare (&end, &jstart) < 0)
+        continue;
+      if (gtk_text_iter_compare (&jstart, &start) < 0)
+        start = jstart;
+      if (gtk_text_iter_compare (&jend, &end) > 0)
+        end = jend;
+      force_all |= job->force_all;
+      job->superseded = TRUE;
+    }
+
+  job = check_job_new (spell, start, end, force_all);
+
+  /* the range may be part of a paragraph, so the worker detects the
+   * languages from a copy of the whole lines */
+  if (spell->priv->detect)
+    {
+      gtk_text_buffer_get_iter_at_mark (job->buffer, &start, job->mark_start);
+      gtk_text_buffer_get_iter_at_mark (job->buffer, &end, job->mark_end);
+      job->context_offset = gtk_text_iter_get_line_offset (&start);
+      gtk_text_iter_set_line_offset (&start, 0);
+      if (!gtk_text_iter_ends_line (&end))
+        gtk_text_iter_forward_to_line_end (&end);
+      job->context = gtk_text_buffer_get_slice (job->buffer, &start, &end, TRUE);
+    }
+
+  g_queue_push_tail (spell->priv->check_jobs, job);
+  job->link = spell->priv->check_jobs->tail;
+
+  /* a single thread per checker, so that results arrive in order */
+  if (!spell->priv->check_pool)
+    spell->priv->check_pool = g_thread_pool_new (check_job_run, NULL,
+                                                 1, FALSE, NULL);
+  g_thread_pool_push (spell->priv->check_pool, job, NULL);
+}
+
+static gboolean
+check_job_apply (gpointer data)
+{
+  CheckJob *job = data;
+  GtkSpellChecker *spell = job->spell;
+  GtkTextIter start, end, wstart, wend;
+  gchar *word;
+  gint offset = 0;
+  guint i;
+
+  /* results for a buffer which was since detached are of no use */
+  if (job->buffer != spell->priv->buffer)
+    {
+      check_job_free (job);
+      return G_SOURCE_REMOVE;
+    }
+
+  if (job->superseded)
+    {
+      check_job_free (job);
+      return G_SOURCE_REMOVE;
+    }
+
+  gtk_text_buffer_get_iter_at_mark (job->buffer, &start, job->mark_start);
+  gtk_text_buffer_get_iter_at_mark (job->buffer, &end, job->mark_end);
+
+  if (job->dirty)
+    {
+      if (debug)
+        g_print ("check job outdated, requeueing\n");
+      /* so that it doesn't take part in the requeued check */
+      job->superseded = TRUE;
+      queue_check_range (spell, start, end, job->force_all);
+      check_job_free (job);
+      return G_SOURCE_REMOVE;
+    }
+
+  /* the offsets are relative to start, so grow a copy of the range */
+  wstart = start;
+  wend = end;
+  unhighlight_range (spell, &wstart, &wend);
+
+  wend = start;
+  for (i = 0; i + 1 < job->misspelled->len; i += 2)
+    {
+      wstart = wend;
+      gtk_text_iter_forward_chars (&wstart, g_array_index (job->misspelled, gint, i) - offset);
+      wend = wstart;
+      gtk_text_iter_forward_chars (&wend, g_array_index (job->misspelled, gint, i + 1) -
+                                          g_array_index (job->misspelled, gint, i));
+      offset = g_array_index (job->misspelled, gint, i + 1);
+      word = gtk_text_iter_get_slice (&wstart, &wend);
+      highlight_range (spell, &wstart, &wend, word);
+      g_free (word);
+    }
+
+  if (job->deferred_check != -1)
+    spell->priv->deferred_check = job->deferred_check;
+
+  check_job_free (job);
+  return G_SOURCE_REMOVE;
+}
+
+/* enchant_dict_check on the shard's dictionary for its language @i,
+ * remembering the verdict */
+static int
+shard_dict_check (CheckJob *job, guint i, const gchar *word, gsize len)
+{
+  GHashTable *verdicts = g_ptr_array_index (job->lang_verdicts, i);
+  gpointer verdict;
+  int result;
+
+  verdict = g_hash_table_lookup (verdicts, word);
+  if (verdict)
+    return verdict == WORD_CORRECT ? 0 : 1;
+
+  result = enchant_dict_check (SHARD_DICT (job, i), word, len);
+  if (result >= 0)
+    g_hash_table_insert (verdicts, g_strdup (word),
+                         result == 0 ? WORD_CORRECT : WORD_MISSPELLED);
+  return result;
+}
+
+/* the counterpart of word_is_correct for the private dictionaries of
+ * shards, which only need to remember verdicts for the current shard */
+static gboolean
+shard_word_is_correct (CheckJob *job, const gchar *tag,
+                       const gchar *word, gsize len)
+{
+  gpointer verdict;
+  int result;
+  guint i;
+
+  if (g_hash_table_contains (job->shards->session, word))
+    return TRUE;
+
+  /* the verdicts are those of all languages, so they don't apply */
+  if (tag)
+    for (i = 0; i < job->spares->len; i++)
+      if (strcmp (job->shards->langs[i], tag) == 0)
+        return shard_dict_check (job, i, word, len) == 0;
+
+  verdict = g_hash_table_lookup (job->verdicts, word);
+  if (verdict)
+    return verdict == WORD_CORRECT;
+
+  result = 1;
+  for (i = 0; i < job->spares->len && result != 0; i++)
+    result = enchant_dict_check (SHARD_DICT (job, i), word, len);
+  if (result >= 0)
+    g_hash_table_insert (job->verdicts, g_strdup (word),
+                         result == 0 ? WORD_CORRECT : WORD_MISSPELLED);
+  return result == 0;
+}
+
+static int
+detect_check_shard (gpointer data, guint i, const gchar *word, gsize len)
+{
+  return shard_dict_check (data, i, word, len);
+}
+
+/* detects the languages of the paragraphs of @text, in which the job's
+ * range starts at character @base.  shards consist of whole paragraphs
+ * and use their private dictionaries for it. */
+static void
+check_job_detect_paragraphs (CheckJob *job, const gchar *text, gint base)
+{
+  GtkSpellChecker *spell = job->spell;
+  Paragraph paragraph;
+  gint delimiter, next, i;
+  gint offset = 0;
+  gchar *sample;
+  gboolean known;
+
+  job->paragraphs = g_array_new (FALSE, FALSE, sizeof (Paragraph));
+  do
+    {
+      pango_find_paragraph_boundary (text, -1, &delimiter, &next);
+
+      sample = detect_sample (text, delimiter);
+      G_LOCK (speller);
+      known = paragraph_lang_lookup (spell, sample, &paragraph.tag);
+      G_UNLOCK (speller);
+
+      if (!known)
+        {
+          if (job->spares)
+            {
+              i = detect_language (sample, job->spares->len,
+                                   detect_check_shard, job);
+              paragraph.tag = i >= 0 ? g_intern_string (job->shards->langs[i]) : NULL;
+              G_LOCK (speller);
+              paragraph_lang_insert (spell, sample, paragraph.tag);
+              G_UNLOCK (speller);
+            }
+          else
+            paragraph.tag = sample_language (spell, sample);
+        }
+      g_free (sample);
+
+      paragraph.start = offset - base;
+      g_array_append_val (job->paragraphs, paragraph);
+
+      offset += g_utf8_strlen (text, next);
+      text += next;
+    }
+  while (*text);
+}
+
+static void
+check_job_word (CheckJob *job, const SegmentWord *w)
+{
+  gchar *word = job->text + w->byte_start;
+  gsize len = w->byte_end - w->byte_start;
+  gchar saved = word[len];
+  const gchar *tag = NULL;
+  gboolean correct;
+
+  if (job->paragraphs)
+    {
+      /* the words come in order */
+      while (job->paragraph + 1 < job->paragraphs->len &&
+             g_array_index (job->paragraphs, Paragraph, job->paragraph + 1).start <= w->start)
+        job->paragraph++;
+      tag = g_array_index (job->paragraphs, Paragraph, job->paragraph).tag;
+    }
+
+  /* like check_word, terminate the word in place */
+  word[len] = '\0';
+  if (g_unichar_isdigit (*word) == TRUE) /* don't check numbers */
+    correct = TRUE;
+  else if (job->spares)
+    correct = shard_word_is_correct (job, tag, word, len);
+  else
+    correct = word_is_correct (job->spell, tag, word, len);
+  word[len] = saved;
+
+  if (!correct)
+    {
+      g_array_append_val (job->misspelled, w->start);
+      g_array_append_val (job->misspelled, w->end);
+    }
+}
+
+/* runs in a worker thread, walks the words just like check_range */
+static void
+check_job_run (gpointer data, gpointer user_data)
+{
+  CheckJob *job = data;
+  SegmentIter words;
+  SegmentWord word;
+  gboolean inword;
+
+  if (job->shards)
+    {
+      /* falls back to the shared dictionaries if this fails */
+      job->spares = shard_spares_take (job->shards->langs);
+      job->verdicts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             (GDestroyNotify) g_free, NULL);
+      if (job->spares)
+        {
+          guint i;
+
+          job->lang_verdicts = g_ptr_array_new_with_free_func ((GDestroyNotify) g_hash_table_unref);
+          for (i = 0; i < job->spares->len; i++)
+            g_ptr_array_add (job->lang_verdicts,
+                             g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    (GDestroyNotify) g_free, NULL));
+        }
+      if (job->shards->detect)
+        check_job_detect_paragraphs (job, job->text, 0);
+    }
+  else if (job->context)
+    {
+      check_job_detect_paragraphs (job, job->context, job->context_offset);
+      g_free (job->context);
+      job->context = NULL;
+    }
+
+  segment_iter_init (&words, job->text, -1);
+  while (segment_iter_next (&words, &word))
+    {
+      inword = (word.start < job->cursor) && (job->cursor <= word.end);
+
+      if (inword && !job->force_all)
+        {
+          if (job->highlight)
+            check_job_word (job, &word);
+          else
+            job->deferred_check = TRUE;
+        }
+      else
+        {
+          check_job_word (job, &word);
+          job->deferred_check = FALSE;
+        }
+    }
+  segment_iter_clear (&words);
+
+  if (job->shards)
+    {
+      ShardSet *shards = job->shards;
+
+      g_hash_table_unref (job->verdicts);
+      job->verdicts = NULL;
+      if (job->lang_verdicts)
+        g_ptr_array_unref (job->lang_verdicts);
+      job->lang_verdicts = NULL;
+      if (job->spares)
+        g_ptr_array_unref (job->spares);
+      job->spares = NULL;
+
+      g_mutex_lock (&shards->lock);
+      if (--shards->pending == 0)
+        g_cond_signal (&shards->cond);
+      g_mutex_unlock (&shards->lock);
+      return;
+    }
+
+  g_idle_add_full (G_PRIORITY_HIGH_IDLE, check_job_apply, job, NULL);
+}
+
+/* checks the entire buffer in parallel shards and waits for the result */
+static void
+recheck_sharded (GtkSpellChecker *spell)
+{
+  g_return_if_fail (spell->priv->speller != NULL);
+
+  GtkTextBuffer *buffer = spell->priv->buffer;
+  GtkTextIter start, end;
+  GPtrArray *jobs;
+  ShardSet shards;
+  CheckJob *job;
+  gint shard_chars;
+  guint i;
+
+  shards.detect = spell->priv->detect && spell->priv->spellers->len > 1;
+  G_LOCK (speller);
+  shards.langs = g_new0 (gchar *, spell->priv->spellers->len + 1);
+  for (i = 0; i < spell->priv->spellers->len; i++)
+    shards.langs[i] = g_strdup (((Speller *) g_ptr_array_index (spell->priv->spellers, i))->lang);
+  shards.session = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          (GDestroyNotify) g_free, NULL);
+  if (spell->priv->word_cache)
+    {
+      GHashTableIter iter;
+      gpointer word;
+      G_LOCK (word_lists);
+      g_hash_table_iter_init (&iter, spell->priv->word_cache->session);
+      while (g_hash_table_iter_next (&iter, &word, NULL))
+        g_hash_table_add (shards.session, g_strdup (word));
+      G_UNLOCK (word_lists);
+    }
+  G_UNLOCK (speller);
+  g_mutex_init (&shards.lock);
+  g_cond_init (&shards.cond);
+
+  if (!shard_pool)
+    shard_pool = g_thread_pool_new (check_job_run, NULL,
+                                    g_get_num_processors (), FALSE, NULL);
+
+  shard_chars = gtk_text_buffer_get_char_count (buffer) /
+                (g_get_num_processors () * SHARDS_PER_PROCESSOR) + 1;
+
+  jobs = g_ptr_array_new ();
+  gtk_text_buffer_get_start_iter (buffer, &start);
+  while (!gtk_text_iter_is_end (&start))
+    {
+      end = start;
+      gtk_text_iter_forward_chars (&end, shard_chars);
+      if (!gtk_text_iter_starts_line (&end))
+        gtk_text_iter_forward_line (&end);
+
+      job = check_job_new (spell, start, end, TRUE);
+      job->shards = &shards;
+      g_ptr_array_add (jobs, job);
+      start = end;
+    }
+
+  shards.pending = jobs->len;
+  for (i = 0; i < jobs->len; i++)
+    g_thread_pool_push (shard_pool, g_ptr_array_index (jobs, i), NULL);
+
+  g_mutex_lock (&shards.lock);
+  while (shards.pending > 0)
+    g_cond_wait (&shards.cond, &shards.lock);
+  g_mutex_unlock (&shards.lock);
+
+  /* the buffer can't have changed while we were waiting */
+  for (i = 0; i < jobs->len; i++)
+    check_job_apply (g_ptr_array_index (jobs, i));
+
+  g_ptr_array_free (jobs, TRUE);
+  g_mutex_clear (&shards.lock);
+  g_cond_clear (&shards.cond);
+  g_hash_table_unref (shards.session);
+  g_strfreev (shards.langs);
+}
+
+/* checks a range which the user has just edited */
+static void
+check_edited_range (GtkSpellChecker *spell, GtkTextIter start,
+                    GtkTextIter end, gboolean force_all)
+{
+  /* edits made while the dictionary loads are checked once it is ready */
+  if (!spell->priv->speller)
+    return;
+
+  if (spell->priv->threaded)
+    queue_check_range (spell, start, end, force_all);
+  else
+    check_range (spell, start, end, force_all);
+}
+
+static void
+check_deferred_range (GtkSpellChecker *spell, gboolean force_all)
+{
+  GtkTextIter start, end;
+
+  if (!spell->priv->speller)
+    return;
+
+  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &start, spell->priv->mark_insert_start);
+  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &end, spell->priv->mark_insert_end);
+  /* a forced check is needed right away */
+  if (force_all)
+    check_range (spell, start, end, force_all);
+  else
+    check_edited_range (spell, start, end, force_all);
+}
+
+/* insertion works like this:
+ *  - before the text is inserted, we mark the position in the buffer.
+ *  - after the text is inserted, we see where our mark is and use that and
+ *    the current position to check the entire range of inserted text.
+ *
+ * this may be overkill for the common case (inserting one character). */
+
+/* with detect-language, an edit among the words of a paragraph's sample
+ * may change the language of the whole paragraph.  the sample is taken
+ * before the edit, and afterwards the edited range is widened to the
+ * paragraph if its language changed, or isn't known yet to a threaded
+ * checker, which leaves detection to the worker thread. */
+static void
+edit_sample_before (GtkSpellChecker *spell, const GtkTextIter *iter)
+{
+  g_free (spell->priv->edit_sample);
+  spell->priv->edit_sample = NULL;
+  if (spell->priv->detect && spell->priv->speller)
+    spell->priv->edit_sample = paragraph_sample_at (spell, iter);
+}
+
+static void
+edit_sample_after (GtkSpellChecker *spell, GtkTextIter *start, GtkTextIter *end)
+{
+  const gchar *old_tag = NULL, *new_tag = NULL;
+  gboolean old_known, new_known, changed;
+  gchar *sample;
+
+  if (!spell->priv->detect || !spell->priv->speller)
+    return;
+
+  sample = paragraph_sample_at (spell, start);
+  changed = g_strcmp0 (sample, spell->priv->edit_sample) != 0;
+  if (changed)
+    {
+      G_LOCK (speller);
+      old_known = paragraph_lang_lookup (spell, spell->priv->edit_sample, &old_tag);
+      new_known = paragraph_lang_lookup (spell, sample, &new_tag);
+      G_UNLOCK (speller);
+      if (!new_known && !spell->priv->threaded)
+        {
+          new_tag = sample_language (spell, sample);
+          new_known = TRUE;
+        }
+      changed = !old_known || !new_known || old_tag != new_tag;
+    }
+  g_free (sample);
+  g_free (spell->priv->edit_sample);
+  spell->priv->edit_sample = NULL;
+
+  if (changed)
+    gtk_text_iter_set_line_offset (start, 0);
+  /* the lines an insertion adds are paragraphs of their own */
+  if ((changed || gtk_text_iter_get_line (start) != gtk_text_iter_get_line (end)) &&
+      !gtk_text_iter_ends_line (end))
+    gtk_text_iter_forward_to_line_end (end);
+}
+
+static void
+insert_text_before (GtkTextBuffer *buffer, GtkTextIter *iter,
+                    gchar *text, gint len, GtkSpellChecker *spell)
+{
+  g_return_if_fail (buffer == spell->priv->buffer);
+
+  gtk_text_buffer_move_mark (buffer, spell->priv->mark_insert_start, iter);
+  edit_sample_before (spell, iter);
+}
+
+static void
+insert_text_after (GtkTextBuffer *buffer, GtkTextIter *iter,
+                   gchar *text, gint len, GtkSpellChecker *spell)
+{
+  g_return_if_fail (buffer == spell->priv->buffer);
+
+  GtkTextIter start, end;
+
+  if (debug)
+    g_print ("insert\n");
+
+  /* we need to check a range of text. */
+  gtk_text_buffer_get_iter_at_mark (buffer, &start, spell->priv->mark_insert_start);
+  end = *iter;
+  edit_sample_after (spell, &start, &end);
+  check_jobs_invalidate (spell, &start, &end);
+  check_edited_range (spell, start, end, FALSE);
+
+  gtk_text_buffer_move_mark (buffer, spell->priv->mark_insert_end, iter);
+}
+
+/* deleting is more simple:  we're given the range of deleted text.
+ * after deletion, the start and end iters should be at the same position
+ * (because all of the text between them was deleted!).
+ * this means we only really check the words immediately bounding the
+ * deletion.
+ */
+
+static void
+delete_range_before (GtkTextBuffer *buffer, GtkTextIter *start,
+                     GtkTextIter *end, GtkSpellChecker *spell)
+{
+  g_return_if_fail (buffer == spell->priv->buffer);
+
+  /* the marks of the words deleted entirely would otherwise linger on */
+  unindex_range (spell, start, end, TRUE);
+  edit_sample_before (spell, start);
+}
+
+static void
+delete_range_after (GtkTextBuffer *buffer, GtkTextIter *start,
+                    GtkTextIter *end, GtkSpellChecker *spell)
+{
+  g_return_if_fail (buffer == spell->priv->buffer);
+
+  GtkTextIter first, last;
+
+  if (debug)
+    g_print ("delete\n");
+  first = *start;
+  last = *end;
+  edit_sample_after (spell, &first, &last);
+  check_jobs_invalidate (spell, &first, &last);
+  check_edited_range (spell, first, last, FALSE);
+}
+
+static void
+mark_set (GtkTextBuffer *buffer, GtkTextIter *iter,
+          GtkTextMark *mark, GtkSpellChecker *spell)
+{
+  g_return_if_fail (buffer == spell->priv->buffer);
+
+  /* if the cursor has moved and there is a deferred check so handle it now */
+  if ((mark == gtk_text_buffer_get_insert (buffer)) && spell->priv->deferred_check)
+    check_deferred_range (spell, FALSE);
+}
+
+static void
+get_word_extents_from_mark (GtkTextBuffer *buffer, GtkTextIter *start,
+                            GtkTextIter *end, GtkTextMark *mark)
+{
+  gtk_text_buffer_get_iter_at_mark (buffer, start, mark);
+  if (!gtk_text_iter_starts_word (start))
+    gtk_text_iter_backward_word_start (start);
+  *end = *start;
+  if (gtk_text_iter_inside_word (end))
+    gtk_text_iter_forward_word_end (end);
+}
+
+static void
+add_to_dictionary (GtkWidget *menuitem, GtkSpellChecker *spell)
+{
+  char *word;
+  GtkTextIter start, end;
+
+  get_word_extents_from_mark (spell->priv->buffer, &start, &end, spell->priv->mark_click);
+  word = gtk_text_buffer_get_text (spell->priv->buffer, &start, &end, FALSE);
+
+  G_LOCK (speller);
+  enchant_dict_add (spell->priv->speller, word, strlen (word));
+  word_cache_invalidate (spell->priv->word_cache, word);
+  word_cache_add_personal (spell->priv->word_cache, word);
+  G_UNLOCK (speller);
+  check_jobs_invalidate (spell, NULL, NULL);
+
+  unhighlight_word (spell, word);
+
+  g_free (word);
+}
+
+static void
+ignore_all (GtkWidget *menuitem, GtkSpellChecker *spell)
+{
+  char *word;
+  GtkTextIter start, end;
+
+  get_word_extents_from_mark (spell->priv->buffer, &start, &end, spell->priv->mark_click);
+  word = gtk_text_buffer_get_text (spell->priv->buffer, &start, &end, FALSE);
+
+  G_LOCK (speller);
+  enchant_dict_add_to_session (spell->priv->speller, word, strlen (word));
+  word_cache_invalidate (spell->priv->word_cache, word);
+  word_cache_add_session (spell->priv->word_cache, word);
+  G_UNLOCK (speller);
+  check_jobs_invalidate (spell, NULL, NULL);
+
+  unhighlight_word (spell, word);
+
+  g_free (word);
+}
+
+static void
+replace_word (GtkWidget *menuitem, GtkSpellChecker *spell)
+{
+  char *oldword;
+  const char *newword;
+  GtkTextIter start, end;
+
+  get_word_extents_from_mark (spell->priv->buffer, &start, &end, spell->priv->mark_click);
+  oldword = gtk_text_buffer_get_text (spell->priv->buffer, &start, &end, FALSE);
+  newword = gtk_label_get_text (GTK_LABEL (gtk_bin_get_child (GTK_BIN (menuitem))));
+
+  if (debug)
+    {
+      g_print ("old word: '%s'\n", oldword);
+      print_iter ("s", &start);
+      print_iter ("e", &end);
+      g_print ("\nnew word: '%s'\n", newword);
+    }
+
+  gtk_text_buffer_begin_user_action (spell->priv->buffer);
+  gtk_text_buffer_delete (spell->priv->buffer, &start, &end);
+  gtk_text_buffer_insert (spell->priv->buffer, &start, newword, -1);
+  gtk_text_buffer_end_user_action (spell->priv->buffer);
+
+  G_LOCK (speller);
+  enchant_dict_store_replacement (spell->priv->speller,
+                                  oldword, strlen (oldword),
+                                  newword, strlen (newword));
+  word_cache_add_replacement (spell->priv->word_cache, oldword, newword);
+  G_UNLOCK (speller);
+
+  g_free (oldword);
+}
+
+static GList *
+suggestions_to_list (gchar **suggestions)
+{
+  GList *result = NULL;
+  gint i;
+
+  for (i = 0; suggestions[i]; i++)
+    result = g_list_prepend (result, g_strdup (suggestions[i]));
+  return g_list_reverse (result);
+}
+
+/* looks the suggestions for @word up in @cache only */
+static gboolean
+suggest_word_cached (WordCache *cache, const gchar *word, GList **result)
+{
+  gchar **suggestions = NULL;
+
+  G_LOCK (word_lists);
+  if (cache)
+    suggestions = g_hash_table_lookup (cache->suggestions, word);
+  if (suggestions)
+    *result = suggestions_to_list (suggestions);
+  G_UNLOCK (word_lists);
+
+  return suggestions != NULL;
+}
+
+/* the suggestions of @dict for @word, as a string vector of our own */
+static gchar **
+dict_suggest (EnchantDict *dict, const gchar *word)
+{
+  char **suggestions;
+  size_t n_suggs = 0, i;
+  gchar **result;
+
+  suggestions = enchant_dict_suggest (dict, word, strlen (word), &n_suggs);
+  result = g_new0 (gchar *, n_suggs + 1);
+  for (i = 0; i < n_suggs; ++i)
+    result[i] = g_strdup (suggestions[i]);
+  if (suggestions)
+    enchant_dict_free_string_list (dict, suggestions);
+
+  return result;
+}
+
+/* may be called from the worker threads.  the suggestions are looked up
+ * with the shared dictionary, which knows the ignored words, unless
+ * @use_spare is set: the backend can take long to suggest, so background
+ * lookups of threaded checkers use a spare instance of the dictionary
+ * instead, while the checks go on with the shared one.  the lookups take
+ * turns with that instance, and a lookup cancelled while waiting for its
+ * turn gives up. */
+static GList *
+suggest_word (GtkSpellChecker *spell, const gchar *word, gboolean use_spare,
+              GCancellable *cancellable)
+{
+  gchar **cached = NULL;
+  GList *result = NULL;
+  WordCache *cache;
+  SpareDict *spare;
+  gchar *lang;
+
+  G_LOCK (speller);
+  cache = spell->priv->word_cache;
+  if (cache)
+    cache->ref_cnt++;
+  lang = g_strdup (spell->priv->lang);
+  G_UNLOCK (speller);
+
+  if (!cache)
+    {
+      g_free (lang);
+      return NULL;
+    }
+
+  if (suggest_word_cached (cache, word, &result))
+    {
+      G_LOCK (speller);
+      word_cache_unref (cache);
+      G_UNLOCK (speller);
+      g_free (lang);
+      return result;
+    }
+
+  if (use_spare)
+    {
+      G_LOCK (suggest);
+      spare = NULL;
+      if (!g_cancellable_is_cancelled (cancellable))
+        spare = spare_dict_take (lang);
+      if (spare)
+        {
+          cached = dict_suggest (spare->dict, word);
+          spare_dict_return (spare);
+        }
+      G_UNLOCK (suggest);
+    }
+  else
+    {
+      G_LOCK (speller);
+      /* the suggestions of another dictionary don't belong in @cache */
+      if (spell->priv->speller && spell->priv->word_cache == cache &&
+          !g_cancellable_is_cancelled (cancellable))
+        cached = dict_suggest (spell->priv->speller, word);
+      G_UNLOCK (speller);
+    }
+
+  if (cached)
+    {
+      result = suggestions_to_list (cached);
+      G_LOCK (word_lists);
+      if (g_hash_table_size (cache->suggestions) >= SUGGESTION_CACHE_MAX_WORDS)
+        g_hash_table_remove_all (cache->suggestions);
+      g_hash_table_insert (cache->suggestions, g_strdup (word), cached);
+      G_UNLOCK (word_lists);
+    }
+
+  G_LOCK (speller);
+  word_cache_unref (cache);
+  G_UNLOCK (speller);
+
+  g_free (lang);
+
+  return result;
+}
+
+static void
+suggestions_free (GList *suggestions)
+{
+  g_list_free_full (suggestions, g_free);
+}
+
+/* the optimal string alignment distance between @a and @b, or @max + 1
+ * once it's known to exceed @max */
+static gint
+edit_distance (const gunichar *a, glong la, const gunichar *b, glong lb, gint max)
+{
+  gint *rows, *prev2, *prev, *cur, *tmp, i, j, row_min, d;
+
+  if (ABS (la - lb) > max)
+    return max + 1;
+
+  rows = g_new (gint, 3 * (lb + 1));
+  prev2 = rows;
+  prev = prev2 + lb + 1;
+  cur = prev + lb + 1;
+  for (j = 0; j <= lb; j++)
+    prev[j] = j;
+
+  for (i = 1; i <= la; i++)
+    {
+      cur[0] = row_min = i;
+      for (j = 1; j <= lb; j++)
+        {
+          d = prev[j - 1] + (a[i - 1] != b[j - 1]);
+          d = MIN (d, prev[j] + 1);
+          d = MIN (d, cur[j - 1] + 1);
+          if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1])
+            d = MIN (d, prev2[j - 2] + 1);
+          cur[j] = d;
+          row_min = MIN (row_min, d);
+        }
+      if (row_min > max)
+        {
+          g_free (rows);
+          return max + 1;
+        }
+      tmp = prev2;
+      prev2 = prev;
+      prev = cur;
+      cur = tmp;
+    }
+
+  d = prev[lb];
+  g_free (rows);
+  return MIN (d, max + 1);
+}
+
+typedef struct _FallbackCandidate FallbackCandidate;
+struct _FallbackCandidate
+{
+  gint distance;
+  guint order;
+  const gchar *word;
+};
+
+static gint
+fallback_candidate_compare (gconstpointer a, gconstpointer b)
+{
+  const FallbackCandidate *ca = a, *cb = b;
+  if (ca->distance != cb->distance)
+    return ca->distance - cb->distance;
+  return ca->order - cb->order;
+}
+
+static void
+fallback_consider (GArray *candidates, GHashTable *seen, const gunichar *word,
+                   glong len, gint max, const gchar *candidate)
+{
+  FallbackCandidate fc;
+  gunichar *chars;
+  gchar *folded;
+  glong n;
+
+  if (g_hash_table_contains (seen, candidate))
+    return;
+  g_hash_table_add (seen, (gpointer) candidate);
+
+  folded = g_utf8_casefold (candidate, -1);
+  chars = g_utf8_to_ucs4_fast (folded, -1, &n);
+  fc.distance = edit_distance (word, len, chars, n, max);
+  g_free (chars);
+  g_free (folded);
+
+  if (fc.distance > max || fc.distance == 0)
+    return;
+  fc.order = candidates->len;
+  fc.word = candidate;
+  g_array_append_val (candidates, fc);
+}
+
+/* picks suggestions for @word among the words the user has added and the
+ * replacements they have made, without asking the backend */
+static GList *
+suggest_word_fallback (GtkSpellChecker *spell, const gchar *word)
+{
+  WordCache *cache;
+  GArray *candidates;
+  GHashTable *seen;
+  GHashTableIter iter;
+  GList *result = NULL, *l;
+  gunichar *chars;
+  gchar *folded;
+  gpointer key;
+  glong len;
+  gint max;
+  guint i;
+
+  folded = g_utf8_casefold (word, -1);
+  chars = g_utf8_to_ucs4_fast (folded, -1, &len);
+  /* allow more edits in longer words */
+  max = len <= 4 ? 1 : len <= 8 ? 2 : 3;
+
+  candidates = g_array_new (FALSE, FALSE, sizeof (FallbackCandidate));
+  seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+  /* the main thread owns the checker's word cache, the lookups in flight
+   * don't keep the word lists from being read */
+  cache = spell->priv->word_cache;
+  G_LOCK (word_lists);
+  if (cache)
+    {
+      /* what this very word was replaced with before goes first */
+      for (l = cache->replacements->head; l; l = l->next)
+        {
+          Replacement *r = l->data;
+          if (strcmp (r->word, word) == 0 && !g_hash_table_contains (seen, r->replacement))
+            {
+              g_hash_table_add (seen, r->replacement);
+              result = g_list_prepend (result, g_strdup (r->replacement));
+            }
+        }
+      for (l = cache->replacements->head; l; l = l->next)
+        fallback_consider (candidates, seen, chars, len, max,
+                           ((Replacement *) l->data)->replacement);
+
+      word_cache_load_personal (cache);
+      for (i = 0; i < cache->personal->len; i++)
+        fallback_consider (candidates, seen, chars, len, max,
+                           g_ptr_array_index (cache->personal, i));
+
+      g_hash_table_iter_init (&iter, cache->session);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        fallback_consider (candidates, seen, chars, len, max, key);
+    }
+
+  g_array_sort (candidates, fallback_candidate_compare);
+  for (i = 0; i < candidates->len && g_list_length (result) < FALLBACK_SUGGESTIONS_MAX; i++)
+    result = g_list_prepend (result,
+                             g_strdup (g_array_index (candidates, FallbackCandidate, i).word));
+  G_UNLOCK (word_lists);
+
+  g_hash_table_unref (seen);
+  g_array_free (candidates, TRUE);
+  g_free (chars);
+  g_free (folded);
+
+  return g_list_reverse (result);
+}
+
+/* prefetching looks the suggestions for newly highlighted words up in the
+ * background, one word at a time, so that they are usually cached by the
+ * time the context menu asks for them */
+static gboolean prefetch_step (gpointer data);
+
+static void
+prefetch_ready (GObject *source, GAsyncResult *result, gpointer data)
+{
+  GtkSpellChecker *spell = GTK_SPELL_CHECKER (source);
+  GCancellable *cancellable = data;
+
+  /* nothing to do with the result, the lookup has cached it */
+  suggestions_free (gtk_spell_checker_get_suggestions_finish (spell, result, NULL));
+
+  if (cancellable == spell->priv->prefetch_cancellable)
+    {
+      g_clear_object (&spell->priv->prefetch_cancellable);
+      if (!g_queue_is_empty (spell->priv->prefetch_queue))
+        spell->priv->prefetch_source = g_idle_add_full (G_PRIORITY_LOW, prefetch_step,
+                                                        spell, NULL);
+    }
+  g_object_unref (cancellable);
+}
+
+static gboolean
+prefetch_step (gpointer data)
+{
+  GtkSpellChecker *spell = data;
+  GList *suggestions;
+  gchar *word;
+
+  spell->priv->prefetch_source = 0;
+
+  while ((word = g_queue_pop_tail (spell->priv->prefetch_queue)))
+    {
+      if (!suggest_word_cached (spell->priv->word_cache, word, &suggestions))
+        break;
+      suggestions_free (suggestions);
+      g_free (word);
+    }
+  if (!word)
+    return G_SOURCE_REMOVE;
+
+  spell->priv->prefetch_cancellable = g_cancellable_new ();
+  gtk_spell_checker_get_suggestions_async (spell, word, spell->priv->prefetch_cancellable,
+                                           prefetch_ready,
+                                           g_object_ref (spell->priv->prefetch_cancellable));
+  g_free (word);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+prefetch_queue_word (GtkSpellChecker *spell, const GtkTextIter *iter,
+                     const gchar *word)
+{
+  GQueue *queue = spell->priv->prefetch_queue;
+  GtkTextIter cursor;
+
+  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &cursor,
+                                    gtk_text_buffer_get_insert (spell->priv->buffer));
+  if (ABS (gtk_text_iter_get_offset (&cursor) - gtk_text_iter_get_offset (iter)) >
+      PREFETCH_DISTANCE_CHARS)
+    return;
+
+  if (g_queue_find_custom (queue, word, (GCompareFunc) strcmp))
+    return;
+  if (g_queue_get_length (queue) >= PREFETCH_QUEUE_MAX)
+    g_free (g_queue_pop_head (queue));
+  g_queue_push_tail (queue, g_strdup (word));
+
+  if (spell->priv->prefetch_source == 0 && !spell->priv->prefetch_cancellable)
+    spell->priv->prefetch_source = g_idle_add_full (G_PRIORITY_LOW, prefetch_step,
+                                                    spell, NULL);
+}
+
+static void
+prefetch_cancel (GtkSpellChecker *spell)
+{
+  g_queue_clear_full (spell->priv->prefetch_queue, g_free);
+
+  if (spell->priv->prefetch_source)
+    {
+      g_source_remove (spell->priv->prefetch_source);
+      spell->priv->prefetch_source = 0;
+    }
+  if (spell->priv->prefetch_cancellable)
+    {
+      g_cancellable_cancel (spell->priv->prefetch_cancellable);
+      g_clear_object (&spell->priv->prefetch_cancellable);
+    }
+}
+
+/* inserts the menu items of the suggestions at @position of @menu,
+ * returns the position following them */
+static gint
+add_suggestion_items (GtkSpellChecker *spell, GtkWidget *menu,
+                      gint position, GList *suggestions)
+{
+  GtkWidget *mi;
+  GList *l;
+  gint i;
+
+  if (suggestions == NULL)
+    {
+      /* no suggestions.  put something in the menu anyway... */
+      GtkWidget *label;
+      label = gtk_label_new ("");
+      gtk_label_set_markup (GTK_LABEL (label), _("<i>(no suggestions)</i>"));
+
+      mi = gtk_menu_item_new ();
+      gtk_container_add (GTK_CONTAINER (mi), label);
+      gtk_widget_show_all (mi);
+      gtk_menu_shell_insert (GTK_MENU_SHELL (menu), mi, position++);
+    }
+  else
+    {
+      /* build a set of menus with suggestions. */
+      gboolean inside_more_submenu = FALSE;
+      for (l = suggestions, i = 0; l; l = l->next, i++)
+        {
+          if (i > 0 && i % 10 == 0)
+            {
+              inside_more_submenu = TRUE;
+              mi = gtk_menu_item_new_with_label (_("More..."));
+              gtk_widget_show (mi);
+              gtk_menu_shell_insert (GTK_MENU_SHELL (menu), mi, position++);
+
+              menu = gtk_menu_new ();
+              gtk_menu_item_set_submenu (GTK_MENU_ITEM (mi), menu);
+            }
+          mi = gtk_menu_item_new_with_label (l->data);
+          g_signal_connect (mi, "activate", G_CALLBACK (replace_word), spell);
+          gtk_widget_show (mi);
+          if (inside_more_submenu)
+            gtk_menu_shell_append (GTK_MENU_SHELL (menu), mi);
+          else
+            gtk_menu_shell_insert (GTK_MENU_SHELL (menu), mi, position++);
+        }
+    }
+
+  return position;
+}
+
+/* the suggestions are looked up in a worker thread while the menu is
+ * already showing, with a placeholder item in their place.  the lookup is
+ * cancelled when the menu is closed. */
+typedef struct _SuggestionMenu SuggestionMenu;
+struct _SuggestionMenu
+{
+  GtkSpellChecker *spell;
+  GtkWidget *menu;
+  GtkWidget *placeholder;
+  GCancellable *cancellable;
+  gulong hide_handler;
+  guint deadline_source;
+};
+
+/* puts the suggestions in place of the placeholder, unless the menu was
+ * closed or torn down meanwhile */
+static void
+suggestion_menu_fill (SuggestionMenu *sm, GList *suggestions)
+{
+  GList *children;
+  gint position;
+
+  if (g_cancellable_is_cancelled (sm->cancellable) ||
+      gtk_widget_get_parent (sm->placeholder) != sm->menu)
+    return;
+
+  children = gtk_container_get_children (GTK_CONTAINER (sm->menu));
+  position = g_list_index (children, sm->placeholder);
+  g_list_free (children);
+
+  gtk_widget_destroy (sm->placeholder);
+  add_suggestion_items (sm->spell, sm->menu, position, suggestions);
+}
+
+/* if the backend hasn't delivered by the deadline, the menu makes do with
+ * the fallback suggestions, if there are any */
+static gboolean
+suggestion_menu_deadline (gpointer data)
+{
+  SuggestionMenu *sm = data;
+  GtkTextIter start, end;
+  GList *suggestions;
+  gchar *word;
+
+  sm->deadline_source = 0;
+
+  if (!sm->spell->priv->buffer)
+    return G_SOURCE_REMOVE;
+
+  get_word_extents_from_mark (sm->spell->priv->buffer, &start, &end,
+                              sm->spell->priv->mark_click);
+  word = gtk_text_buffer_get_text (sm->spell->priv->buffer, &start, &end, FALSE);
+  suggestions = suggest_word_fallback (sm->spell, word);
+  if (suggestions)
+    suggestion_menu_fill (sm, suggestions);
+  suggestions_free (suggestions);
+  g_free (word);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+suggestion_menu_ready (GObject *source, GAsyncResult *result, gpointer data)
+{
+  SuggestionMenu *sm = data;
+  GList *suggestions;
+
+  suggestions = gtk_spell_checker_get_suggestions_finish (sm->spell, result, NULL);
+  suggestion_menu_fill (sm, suggestions);
+  suggestions_free (suggestions);
+
+  if (sm->deadline_source)
+    g_source_remove (sm->deadline_source);
+  g_signal_handler_disconnect (sm->menu, sm->hide_handler);
+  g_object_unref (sm->cancellable);
+  g_object_unref (sm->placeholder);
+  g_object_unref (sm->menu);
+  g_object_unref (sm->spell);
+  g_slice_free (SuggestionMenu, sm);
+}
+
+/* This function populates suggestions at the top of the passed menu */
+static void
+add_suggestion_menus (GtkSpellChecker *spell, const char *word, GtkWidget *topmenu)
+{
+  g_return_if_fail (spell->priv->speller != NULL);
+
+  GtkWidget *mi, *label;
+  SuggestionMenu *sm = NULL;
+  GList *suggestions;
+  char *text;
+
+  gint menu_position = 0;
+
+  if (suggest_word_cached (spell->priv->word_cache, word, &suggestions))
+    {
+      menu_position = add_suggestion_items (spell, topmenu, menu_position, suggestions);
+      suggestions_free (suggestions);
+    }
+  else
+    {
+      /* the suggestions go in place of this, once they are known */
+      label = gtk_label_new ("");
+      gtk_label_set_markup (GTK_LABEL (label), _("<i>(looking up suggestions...)</i>"));
+      mi = gtk_menu_item_new ();
+      gtk_widget_set_sensitive (mi, FALSE);
+      gtk_container_add (GTK_CONTAINER (mi), label);
+      gtk_widget_show_all (mi);
+      gtk_menu_shell_insert (GTK_MENU_SHELL (topmenu), mi, menu_position++);
+
+      sm = g_slice_new (SuggestionMenu);
+      sm->spell = g_object_ref (spell);
+      sm->menu = g_object_ref (topmenu);
+      sm->placeholder = g_object_ref (mi);
+      sm->cancellable = g_cancellable_new ();
+      sm->hide_handler = g_signal_connect_swapped (topmenu, "hide",
+                                                   G_CALLBACK (g_cancellable_cancel),
+                                                   sm->cancellable);
+      sm->deadline_source = g_timeout_add (SUGGESTION_MENU_DEADLINE_MS,
+                                           suggestion_menu_deadline, sm);
+    }
+
+  /* + Add to Dictionary */
+  text = g_strdup_printf (_("Add \"%s\" to Dictionary"), word);
+#if GTK_CHECK_VERSION(3,9,0)
+  mi = gtk_menu_item_new_with_label (text);
+#else
+  mi = gtk_image_menu_item_new_with_label (text);
+  gtk_image_menu_item_set_image (GTK_IMAGE_MENU_ITEM (mi),
+                 gtk_image_new_from_stock (GTK_STOCK_ADD, GTK_ICON_SIZE_MENU));
+#endif
+  g_free (text);
+  g_signal_connect (mi, "activate", G_CALLBACK (add_to_dictionary), spell);
+  gtk_widget_show_all (mi);
+  gtk_menu_shell_insert (GTK_MENU_SHELL (topmenu), mi, menu_position++);
+
+  /* - Ignore All */
+#if GTK_CHECK_VERSION(3,9,0)
+  mi = gtk_menu_item_new_with_label (_("Ignore All"));
+#else
+  mi = gtk_image_menu_item_new_with_label (_("Ignore All"));
+  gtk_image_menu_item_set_image (GTK_IMAGE_MENU_ITEM (mi),
+              gtk_image_new_from_stock (GTK_STOCK_REMOVE, GTK_ICON_SIZE_MENU));
+#endif
+  g_signal_connect (mi, "activate", G_CALLBACK (ignore_all), spell);
+  gtk_widget_show_all (mi);
+  gtk_menu_shell_insert (GTK_MENU_SHELL (topmenu), mi, menu_position++);
+
+  /* the menu looks up with the shared dictionary, which ignores the same
+   * words as the checks */
+  if (sm)
+    suggest_word_async (spell, word, FALSE, sm->cancellable,
+                        suggestion_menu_ready, sm);
+}
+
+static GtkWidget*
+build_suggestion_menu (GtkSpellChecker *spell, const char *word)
+{
+  GtkWidget *topmenu;
+  topmenu = gtk_menu_new ();
+  add_suggestion_menus (spell, word, topmenu);
+
+  return topmenu;
+}
+
+static void
+language_change_ready (GObject *source, GAsyncResult *result, gpointer data)
+{
+  GtkSpellChecker *spell = GTK_SPELL_CHECKER (source);
+
+  if (gtk_spell_checker_set_language_finish (spell, result, NULL))
+    g_signal_emit (spell, signals[LANGUAGE_CHANGED], 0, spell->priv->lang);
+}
+
+static void
+language_change_callback (GtkCheckMenuItem *mi, GtkSpellChecker* spell)
+{
+  if (gtk_check_menu_item_get_active (mi))
+    {
+      gchar *name;
+      g_object_get (G_OBJECT (mi), "name", &name, NULL);
+      /* the menu doesn't wait for the dictionary to load */
+      gtk_spell_checker_set_language_async (spell, name, NULL,
+                                            language_change_ready, NULL);
+      g_free (name);
+    }
+}
+
+/* the list of the dictionaries the broker offers is kept for as long as
+ * the broker lives, sorted by tag and with the labels decoded.  the broker
+ * scans the dictionary directories for it, so changes to them drop the
+ * list, for the next request to build it afresh. */
+typedef struct _Language Language;
+struct _Language
+{
+  gchar *tag;
+  gchar *label; /* the decoded language code, or NULL */
+};
+
+static GPtrArray *languages = NULL;
+static GPtrArray *language_monitors = NULL;
+
+/* where the usual enchant providers find their dictionaries */
+static const gchar *const dictionary_dirs[] = {
+  "hunspell", "myspell", "myspell/dicts", "enchant", "nuspell"
+};
+
+#ifdef HAVE_ISO_CODES
+/* "sr_RS@latin" -> "Serbian (Serbia, latin)" */
+static gchar*
+language_label (const gchar *tag)
+{
+  CodetableName name;
+
+  codetable_lookup (tag, &name);
+  if (name.country_len != 0 && name.variant_len != 0)
+    return g_strdup_printf ("%.*s (%.*s, %.*s)", name.language_len, name.language,
+                            name.country_len, name.country,
+                            name.variant_len, name.variant);
+  else if (name.country_len != 0)
+    return g_strdup_printf ("%.*s (%.*s)", name.language_len, name.language,
+                            name.country_len, name.country);
+  else if (name.variant_len != 0)
+    return g_strdup_printf ("%.*s (%.*s)", name.language_len, name.language,
+                            name.variant_len, name.variant);
+  else
+    return g_strndup (name.language, name.language_len);
+}
+#endif
+
+static void
+language_free (Language *language)
+{
+  g_free (language->tag);
+  g_free (language->label);
+  g_slice_free (Language, language);
+}
+
+static gint
+language_compare (gconstpointer a, gconstpointer b)
+{
+  const Language *la = *(const Language **) a, *lb = *(const Language **) b;
+  return strcmp (la->tag, lb->tag);
+}
+
+static void
+language_describe_cb (const char * const lang_tag,
+                      const char * const provider_name,
+                      const char * const provider_desc,
+                      const char * const provider_file,
+                      void * user_data)
+{
+  Language *language = g_slice_new0 (Language);
+  language->tag = g_strdup (lang_tag);
+  g_ptr_array_add (user_data, language);
+}
+
+static void
+languages_invalidate (void)
+{
+  if (languages)
+    {
+      g_ptr_array_unref (languages);
+      languages = NULL;
+    }
+}
+
+static void
+dictionary_dir_changed (GFileMonitor *monitor, GFile *file, GFile *other,
+                        GFileMonitorEvent event, gpointer data)
+{
+  G_LOCK (broker);
+  languages_invalidate ();
+  G_UNLOCK (broker);
+}
+
+static void
+language_monitor_add (const gchar *path)
+{
+  GFileMonitor *monitor;
+  GFile *dir;
+
+  if (!g_file_test (path, G_FILE_TEST_IS_DIR))
+    return;
+
+  dir = g_file_new_for_path (path);
+  monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_NONE, NULL, NULL);
+  if (monitor)
+    {
+      g_signal_connect (monitor, "changed", G_CALLBACK (dictionary_dir_changed), NULL);
+      g_ptr_array_add (language_monitors, monitor);
+    }
+  g_object_unref (dir);
+}
+
+static void
+language_monitors_start (void)
+{
+  const gchar *const *data_dirs;
+  gchar *path;
+  guint i, j;
+
+  language_monitors = g_ptr_array_new_with_free_func (g_object_unref);
+
+  path = g_build_filename (g_get_user_config_dir (), "enchant", NULL);
+  language_monitor_add (path);
+  g_free (path);
+  for (i = 0; i < G_N_ELEMENTS (dictionary_dirs); i++)
+    {
+      path = g_build_filename (g_get_user_config_dir (), "enchant", dictionary_dirs[i], NULL);
+      language_monitor_add (path);
+      g_free (path);
+    }
+
+  data_dirs = g_get_system_data_dirs ();
+  for (j = 0; data_dirs[j]; j++)
+    for (i = 0; i < G_N_ELEMENTS (dictionary_dirs); i++)
+      {
+        path = g_build_filename (data_dirs[j], dictionary_dirs[i], NULL);
+        language_monitor_add (path);
+        g_free (path);
+      }
+}
+
+/* drops the list along with the broker */
+static void
+languages_free (void)
+{
+  languages_invalidate ();
+  if (language_monitors)
+    {
+      g_ptr_array_unref (language_monitors);
+      language_monitors = NULL;
+    }
+}
+
+static GPtrArray *
+languages_get (void)
+{
+  guint i, j;
+
+  if (languages)
+    return languages;
+
+  if (!language_monitors)
+    language_monitors_start ();
+
+  languages = g_ptr_array_new_with_free_func ((GDestroyNotify) language_free);
+  enchant_broker_list_dicts (broker, language_describe_cb, languages);
+  g_ptr_array_sort (languages, language_compare);
+
+  /* several providers may offer the same language */
+  for (i = 0, j = 0; i < languages->len; i++)
+    {
+      if (j > 0 && language_compare (&g_ptr_array_index (languages, i),
+                                     &g_ptr_array_index (languages, j - 1)) == 0)
+        {
+          language_free (g_ptr_array_index (languages, i));
+          continue;
+        }
+      g_ptr_array_index (languages, j++) = g_ptr_array_index (languages, i);
+    }
+  g_ptr_array_set_size (languages, j);
+
+#ifdef HAVE_ISO_CODES
+  for (i = 0; i < languages->len; i++)
+    {
+      Language *language = g_ptr_array_index (languages, i);
+      language->label = language_label (language->tag);
+    }
+#endif
+
+  return languages;
+}
+
+/* the broker functions are called with the broker lock held */
+static void
+broker_acquire (void)
+{
+  if (broker_release_source)
+    {
+      g_source_remove (broker_release_source);
+      broker_release_source = 0;
+    }
+  if (!broker)
+    {
+      broker = enchant_broker_init ();
+      broker_ref_cnt = 0;
+    }
+  broker_ref_cnt++;
+}
+
+static gboolean
+broker_release_timeout (gpointer data)
+{
+  G_LOCK (broker);
+  broker_release_source = 0;
+  if (broker_ref_cnt == 0 && broker)
+    {
+      dict_pool_trim (0, 0);
+      languages_free ();
+      enchant_broker_free (broker);
+      broker = NULL;
+
+      if (shard_pool)
+        {
+          g_thread_pool_free (shard_pool, FALSE, TRUE);
+          shard_pool = NULL;
+        }
+    }
+  G_UNLOCK (broker);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+broker_release (void)
+{
+  broker_ref_cnt--;
+  if (broker_ref_cnt == 0 && broker_release_source == 0)
+    broker_release_source = g_timeout_add_seconds (BROKER_KEEP_ALIVE_SECONDS,
+                                                   broker_release_timeout, NULL);
+}
+
+static void
+populate_languages_menu (GtkSpellChecker *spell, GtkWidget *menu)
+{
+  GtkWidget *active_item = NULL;
+  GPtrArray *langs;
+  GtkWidget *mi;
+  GSList *menu_group = NULL;
+  gchar **tags = NULL;
+  guint i;
+
+  G_LOCK (broker);
+  langs = languages_get ();
+  if (spell->priv->preload)
+    tags = g_new0 (gchar *, langs->len + 1);
+
+  for (i = 0; i < langs->len; i++)
+    {
+      Language *language = g_ptr_array_index (langs, i);
+      if (spell->priv->decode_codes == TRUE && language->label)
+        mi = gtk_radio_menu_item_new_with_label (menu_group, language->label);
+      else
+        mi = gtk_radio_menu_item_new_with_label (menu_group, language->tag);
+      menu_group = gtk_radio_menu_item_get_group (GTK_RADIO_MENU_ITEM (mi));
+
+      g_object_set (G_OBJECT (mi), "name", language->tag, NULL);
+      if (spell->priv->lang && strcmp (spell->priv->lang, language->tag) == 0)
+        active_item = mi;
+      if (tags)
+        tags[i] = g_strdup (language->tag);
+      gtk_widget_show (mi);
+      gtk_menu_shell_append (GTK_MENU_SHELL (menu), mi);
+    }
+  G_UNLOCK (broker);
+
+  if (active_item)
+    gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (active_item), TRUE);
+  else
+    {
+      /* For the situation where no language is active (i.e.
+       * spell->priv->lang == NULL), create a "None" item which is active. */
+      mi = gtk_radio_menu_item_new_with_label (menu_group, _("None"));
+      gtk_menu_shell_append (GTK_MENU_SHELL (menu), mi);
+      gtk_check_menu_item_set_active (GTK_CHECK_MENU_ITEM (mi), TRUE);
+      gtk_widget_show (mi);
+    }
+  /* Connect signals to menu items after determining which one is active,
+   * since otherwise the signal is potentially already fired once (since the
+   * first item added to the group is active by default. */
+  for (; menu_group; menu_group = menu_group->next)
+    {
+        mi = menu_group->data;
+        if (!gtk_check_menu_item_get_active (GTK_CHECK_MENU_ITEM (mi)))
+          g_signal_connect (mi, "activate",
+                            G_CALLBACK (language_change_callback), spell);
+    }
+
+  if (tags)
+    languages_preload_start (spell, menu, tags);
+}
+
+/* the languages submenu is only filled in when the user gets to it */
+static void
+languages_menu_select (GtkMenuItem *item, GtkSpellChecker *spell)
+{
+  GtkWidget *menu = gtk_menu_item_get_submenu (item);
+
+  g_signal_handlers_disconnect_by_func (item, languages_menu_select, spell);
+  populate_languages_menu (spell, menu);
+}
+
+static void
+populate_popup (GtkTextView *textview, GtkMenu *menu, GtkSpellChecker *spell)
+{
+  g_return_if_fail (spell->priv->view == textview);
+
+  GtkWidget *mi;
+  GtkTextIter start, end;
+  char *word;
+
+  /* menu separator comes first. */
+  mi = gtk_separator_menu_item_new ();
+  gtk_widget_show (mi);
+  gtk_menu_shell_prepend (GTK_MENU_SHELL (menu), mi);
+
+  /* on top: language selection */
+  mi = gtk_menu_item_new_with_label (_("Languages"));
+  gtk_menu_item_set_submenu (GTK_MENU_ITEM (mi), gtk_menu_new ());
+  g_signal_connect (mi, "select", G_CALLBACK (languages_menu_select), spell);
+  gtk_widget_show_all (mi);
+  gtk_menu_shell_prepend (GTK_MENU_SHELL (menu), mi);
+
+  /* we need to figure out if they picked a misspelled word. */
+  get_word_extents_from_mark (spell->priv->buffer, &start, &end, spell->priv->mark_click);
+
+  /* if our highlight algorithm ever messes up,
+   * this isn't correct, either. */
+  if (!gtk_text_iter_has_tag (&start, spell->priv->tag_highlight) ||
+      !spell->priv->speller)
+    return; /* word wasn't misspelled. */
+
+  /* then, on top of it, the suggestions */
+  word = gtk_text_buffer_get_text (spell->priv->buffer, &start, &end, FALSE);
+  add_suggestion_menus (spell, word, GTK_WIDGET (menu));
+  g_free (word);
+}
+
+/* when the user right-clicks on a word, they want to check that word.
+ * here, we do NOT  move the cursor to the location of the clicked-upon word
+ * since that prevents the use of edit functions on the context menu. */
+static gboolean
+button_press_event (GtkTextView *view, GdkEventButton *event, GtkSpellChecker *spell)
+{
+  g_return_val_if_fail (spell->priv->view == view, FALSE);
+  g_return_val_if_fail (spell->priv->buffer == gtk_text_view_get_buffer (view), FALSE);
+
+  if (event->button == 3)
+    {
+      gint x, y;
+      GtkTextIter iter;
+
+      /* handle deferred check if it exists */
+      if (spell->priv->deferred_check)
+        check_deferred_range (spell, TRUE);
+
+      gtk_text_view_window_to_buffer_coords (view, GTK_TEXT_WINDOW_TEXT,
+                                             event->x, event->y, &x, &y);
+      gtk_text_view_get_iter_at_location (view, &iter, x, y);
+      gtk_text_buffer_move_mark (spell->priv->buffer, spell->priv->mark_click, &iter);
+    }
+  return FALSE; /* false: let gtk process this event, too.
+                 * we don't want to eat any events. */
+}
+
+/* This event occurs when the popup menu is requested through a key-binding
+ * (Menu Key or <shift>+F10 by default).  In this case we want to set
+ * spell->priv->mark_click to the cursor position. */
+static gboolean
+popup_menu_event (GtkTextView *view, GtkSpellChecker *spell)
+{
+  g_return_val_if_fail (spell->priv->view == view, FALSE);
+
+  GtkTextIter iter;
+
+  gtk_text_buffer_get_iter_at_mark (spell->priv->buffer, &iter,
+                                   gtk_text_buffer_get_insert (spell->priv->buffer));
+  gtk_text_buffer_move_mark (spell->priv->buffer, spell->priv->mark_click, &iter);
+  return FALSE; /* false: let gtk process this event, too. */
+}
+
+/* brings a language tag into the form enchant describes its dictionaries
+ * with: "en-us.UTF-8@euro" and "en_US" both become "en_US" */
+static gchar*
+language_tag_normalize (const gchar *lang)
+{
+  GString *tag;
+  gboolean region = FALSE;
+  const gchar *p;
+
+  tag = g_string_sized_new (strlen (lang));
+  for (p = lang; *p && *p != '.' && *p != '@'; p++)
+    {
+      if (*p == '-' || *p == '_')
+        {
+          region = TRUE;
+          g_string_append_c (tag, '_');
+        }
+      else if (region)
+        g_string_append_c (tag, g_ascii_toupper (*p));
+      else
+        g_string_append_c (tag, g_ascii_tolower (*p));
+    }
+
+  return g_string_free (tag, FALSE);
+}
+
+static void
+dict_pool_describe_cb (const char * const lang_tag,
+                       const char * const provider_name,
+                       const char * const provider_desc,
+                       const char * const provider_dll_file,
+                       void * user_data)
+{
+  gchar **tag = user_data;
+
+  *tag = language_tag_normalize (lang_tag);
+}
+
+static void
+dict_pool_add_tag (PooledDict *pooled, gchar *tag)
+{
+  if (g_hash_table_contains (dict_pool, tag))
+    {
+      g_free (tag);
+      return;
+    }
+  g_ptr_array_add (pooled->tags, tag);
+  g_hash_table_insert (dict_pool, tag, pooled);
+}
+
+/* estimates the memory a dictionary takes by the size of its word list */
+static gsize
+dict_size_estimate (const gchar *tag)
+{
+  const gchar *const *data_dirs;
+  gchar *name, *path;
+  GStatBuf st;
+  gsize size = 0;
+  guint i, j;
+
+  name = g_strconcat (tag, ".dic", NULL);
+  data_dirs = g_get_system_data_dirs ();
+  for (j = 0; data_dirs[j] && size == 0; j++)
+    for (i = 0; i < G_N_ELEMENTS (dictionary_dirs) && size == 0; i++)
+      {
+        path = g_build_filename (data_dirs[j], dictionary_dirs[i], name, NULL);
+        if (g_stat (path, &st) == 0)
+          size = st.st_size * DICT_SIZE_FACTOR;
+        g_free (path);
+      }
+  g_free (name);
+
+  return size ? size : DICT_SIZE_UNKNOWN;
+}
+
+static PooledDict*
+dict_pool_insert (EnchantDict *dict, gchar *dict_tag)
+{
+  PooledDict *pooled;
+
+  pooled = g_slice_new0 (PooledDict);
+  pooled->dict = dict;
+  pooled->tags = g_ptr_array_new_with_free_func (g_free);
+  pooled->size = dict_size_estimate (dict_tag ? dict_tag : "");
+  g_hash_table_insert (dict_pool_dicts, dict, pooled);
+  if (dict_tag)
+    dict_pool_add_tag (pooled, dict_tag);
+
+  return pooled;
+}
+
+static void
+dict_pool_destroy (PooledDict *pooled)
+{
+  EnchantDict *dict = pooled->dict;
+  guint i;
+
+  for (i = 0; i < pooled->tags->len; i++)
+    g_hash_table_remove (dict_pool, g_ptr_array_index (pooled->tags, i));
+  g_hash_table_remove (dict_pool_dicts, dict);
+  g_ptr_array_unref (pooled->tags);
+
+  if (pooled->broker)
+    {
+      enchant_broker_free_dict (pooled->broker, dict);
+      enchant_broker_free (pooled->broker);
+    }
+  else
+    enchant_broker_free_dict (broker, dict);
+  g_slice_free (PooledDict, pooled);
+
+  if (g_hash_table_size (dict_pool_dicts) == 0)
+    {
+      g_hash_table_unref (dict_pool);
+      g_hash_table_unref (dict_pool_dicts);
+      dict_pool = NULL;
+      dict_pool_dicts = NULL;
+      spare_dicts_free ();
+    }
+}
+
+/* unused dictionaries are kept loaded, the most recently used first, as
+ * long as they fit into the limits */
+static void
+dict_pool_take_warm (PooledDict *pooled)
+{
+  if (!pooled->warm_link)
+    return;
+  g_queue_delete_link (&dict_warm, pooled->warm_link);
+  pooled->warm_link = NULL;
+  dict_warm_size -= pooled->size;
+}
+
+static void
+dict_pool_trim (guint max_dicts, gsize max_bytes)
+{
+  PooledDict *pooled;
+
+  while (dict_warm.length > 0
+         && (dict_warm.length > max_dicts || dict_warm_size > max_bytes))
+    {
+      pooled = g_queue_peek_tail (&dict_warm);
+      dict_pool_take_warm (pooled);
+      dict_pool_destroy (pooled);
+    }
+}
+
+/* called with the broker lock held */
+static EnchantDict*
+dict_pool_ref (const gchar *lang)
+{
+  PooledDict *pooled;
+  EnchantDict *dict;
+  gchar *tag, *dict_tag = NULL;
+
+  if (!dict_pool)
+    {
+      dict_pool = g_hash_table_new (g_str_hash, g_str_equal);
+      dict_pool_dicts = g_hash_table_new (NULL, NULL);
+    }
+
+  tag = language_tag_normalize (lang);
+  pooled = g_hash_table_lookup (dict_pool, tag);
+  if (pooled)
+    {
+      g_free (tag);
+      dict_pool_take_warm (pooled);
+      pooled->ref_cnt++;
+      return pooled->dict;
+    }
+
+  dict = enchant_broker_request_dict (broker, lang);
+  if (!dict)
+    {
+      g_free (tag);
+      return NULL;
+    }
+
+  /* a generic tag like "en" may resolve to a dictionary that is pooled
+   * already under its own tag */
+  enchant_dict_describe (dict, dict_pool_describe_cb, &dict_tag);
+  pooled = g_hash_table_lookup (dict_pool_dicts, dict);
+  if (!pooled && dict_tag)
+    pooled = g_hash_table_lookup (dict_pool, dict_tag);
+
+  if (pooled)
+    {
+      g_free (dict_tag);
+      enchant_broker_free_dict (broker, dict);
+      dict_pool_take_warm (pooled);
+    }
+  else
+    pooled = dict_pool_insert (dict, dict_tag);
+
+  dict_pool_add_tag (pooled, tag);
+  pooled->ref_cnt++;
+
+  return pooled->dict;
+}
+
+/* called with the broker lock held */
+static void
+dict_pool_unref (EnchantDict *dict)
+{
+  PooledDict *pooled;
+
+  if (!dict || !dict_pool_dicts)
+    return;
+
+  pooled = g_hash_table_lookup (dict_pool_dicts, dict);
+  g_return_if_fail (pooled != NULL);
+
+  if (--pooled->ref_cnt > 0)
+    return;
+
+  g_queue_push_head (&dict_warm, pooled);
+  pooled->warm_link = dict_warm.head;
+  dict_warm_size += pooled->size;
+  dict_pool_trim (dict_warm_max, dict_warm_budget);
+}
+
+/* whether a dictionary for @lang is pooled. called with the broker lock
+ * held. */
+static gboolean
+dict_pool_contains (const gchar *lang)
+{
+  gchar *tag;
+  gboolean found;
+
+  if (!dict_pool)
+    return FALSE;
+
+  tag = language_tag_normalize (lang);
+  found = g_hash_table_contains (dict_pool, tag);
+  g_free (tag);
+
+  return found;
+}
+
+/* loads a dictionary for the pool without the broker lock held, from a
+ * broker of its own since the shared one must not be used meanwhile. the
+ * pool takes over both with dict_pool_adopt. */
+static EnchantDict*
+dict_load (const gchar *lang, EnchantBroker **owner)
+{
+  EnchantDict *dict;
+
+  *owner = enchant_broker_init ();
+  dict = enchant_broker_request_dict (*owner, lang);
+  if (!dict)
+    {
+      enchant_broker_free (*owner);
+      *owner = NULL;
+    }
+
+  return dict;
+}
+
+/* pools @dict, which dict_load loaded from @owner for @lang, unless a
+ * dictionary for the language was pooled meanwhile, which is then
+ * returned instead. called with the broker lock held. */
+static PooledDict*
+dict_pool_adopt (EnchantBroker *owner, EnchantDict *dict, const gchar *lang)
+{
+  PooledDict *pooled;
+  gchar *tag, *dict_tag = NULL;
+
+  if (!dict_pool)
+    {
+      dict_pool = g_hash_table_new (g_str_hash, g_str_equal);
+      dict_pool_dicts = g_hash_table_new (NULL, NULL);
+    }
+
+  tag = language_tag_normalize (lang);
+  enchant_dict_describe (dict, dict_pool_describe_cb, &dict_tag);
+  pooled = g_hash_table_lookup (dict_pool, tag);
+  if (!pooled && dict_tag)
+    pooled = g_hash_table_lookup (dict_pool, dict_tag);
+
+  if (pooled)
+    {
+      g_free (dict_tag);
+      enchant_broker_free_dict (owner, dict);
+      enchant_broker_free (owner);
+    }
+  else
+    {
+      pooled = dict_pool_insert (dict, dict_tag);
+      pooled->broker = owner;
+    }
+  dict_pool_add_tag (pooled, tag);
+
+  return pooled;
+}
+
+/* puts a dictionary loaded ahead of use into the warm list. called with
+ * the broker lock held. */
+static void
+dict_pool_preload (EnchantBroker *owner, EnchantDict *dict, const gchar *lang)
+{
+  PooledDict *pooled = dict_pool_adopt (owner, dict, lang);
+
+  if (pooled->ref_cnt > 0 || pooled->warm_link)
+    return;
+
+  /* preloaded dictionaries go last, they are guesses */
+  g_queue_push_tail (&dict_warm, pooled);
+  pooled->warm_link = dict_warm.tail;
+  dict_warm_size += pooled->size;
+  dict_pool_trim (dict_warm_max, dict_warm_budget);
+}
+
+/* like dict_pool_ref, but loads a dictionary which isn't pooled yet with
+ * the broker lock released, for the worker threads. takes the broker lock
+ * itself. */
+static EnchantDict*
+dict_pool_ref_load (const gchar *lang)
+{
+  EnchantBroker *owner;
+  PooledDict *pooled;
+  EnchantDict *dict = NULL;
+
+  G_LOCK (broker);
+  if (dict_pool_contains (lang))
+    dict = dict_pool_ref (lang);
+  G_UNLOCK (broker);
+  if (dict)
+    return dict;
+
+  dict = dict_load (lang, &owner);
+  if (!dict)
+    return NULL;
+
+  G_LOCK (broker);
+  pooled = dict_pool_adopt (owner, dict, lang);
+  dict_pool_take_warm (pooled);
+  pooled->ref_cnt++;
+  dict = pooled->dict;
+  G_UNLOCK (broker);
+
+  return dict;
+}
+
+static void
+languages_preload_thread (GTask *task, gpointer source, gpointer data,
+                          GCancellable *cancellable)
+{
+  gchar **tags = data;
+  EnchantBroker *owner;
+  EnchantDict *dict;
+  gboolean full, pooled;
+  guint i;
+
+  for (i = 0; tags[i]; i++)
+    {
+      if (g_cancellable_is_cancelled (cancellable))
+        break;
+
+      G_LOCK (broker);
+      full = dict_warm.length >= dict_warm_max || dict_warm_size >= dict_warm_budget;
+      pooled = dict_pool_contains (tags[i]);
+      if (!full && !pooled)
+        broker_acquire ();
+      G_UNLOCK (broker);
+      if (full)
+        break;
+      if (pooled)
+        continue;
+
+      /* the menu stays usable while the dictionary loads */
+      dict = dict_load (tags[i], &owner);
+      G_LOCK (broker);
+      if (dict)
+        dict_pool_preload (owner, dict, tags[i]);
+      broker_release ();
+      G_UNLOCK (broker);
+    }
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+languages_preload_stop (GtkWidget *menu, GtkSpellChecker *spell)
+{
+  if (spell->priv->preload_cancellable)
+    {
+      g_cancellable_cancel (spell->priv->preload_cancellable);
+      g_clear_object (&spell->priv->preload_cancellable);
+    }
+}
+
+/* loads the dictionaries listed in the languages menu while it is open,
+ * as far as the warm dictionaries' limits allow */
+static void
+languages_preload_start (GtkSpellChecker *spell, GtkWidget *menu, gchar **tags)
+{
+  GTask *task;
+
+  languages_preload_stop (menu, spell);
+  spell->priv->preload_cancellable = g_cancellable_new ();
+  g_signal_connect_object (menu, "hide",
+                           G_CALLBACK (languages_preload_stop), spell, 0);
+
+  task = g_task_new (spell, spell->priv->preload_cancellable, NULL, NULL);
+  g_task_set_task_data (task, tags, (GDestroyNotify) g_strfreev);
+  g_task_set_priority (task, G_PRIORITY_LOW);
+  g_task_run_in_thread (task, languages_preload_thread);
+  g_object_unref (task);
+}
+
+static void
+set_lang_from_dict (const char * const lang_tag,
+                    const char * const provider_name,
+                    const char * const provider_desc,
+                    const char * const provider_dll_file,
+                    void * user_data)
+{
+  Speller *sp = user_data;
+
+  g_free (sp->lang);
+  sp->lang = g_strdup (lang_tag);
+}
+
+/* called with the broker and the speller lock held */
+static void
+spellers_free (GPtrArray *spellers)
+{
+  guint i;
+
+  if (!spellers)
+    return;
+
+  for (i = 0; i < spellers->len; i++)
+    {
+      Speller *sp = g_ptr_array_index (spellers, i);
+      dict_pool_unref (sp->dict);
+      word_cache_unref (sp->cache);
+      g_free (sp->lang);
+      g_slice_free (Speller, sp);
+    }
+  g_ptr_array_unref (spellers);
+}
+
+static const gchar*
+language_resolve (const gchar *lang)
+{
+  if (lang == NULL)
+    {
+      lang = g_getenv ("LANG");
+      if (lang)
+        {
+          if ((strcmp (lang, "C") == 0) || (strcmp (lang, "c") == 0))
+            lang = NULL;
+          else if (lang[0] == 0)
+            lang = NULL;
+        }
+    }
+
+  if (!lang)
+    lang = "en";
+
+  return lang;
+}
+
+/* takes over the references to the @n_dicts dictionaries, the first of
+ * which becomes the one new words are added to. called with the broker
+ * lock held. */
+static void
+set_language_dicts (GtkSpellChecker *spell, EnchantDict **dicts, guint n_dicts)
+{
+  GPtrArray *old;
+  Speller *sp;
+  guint i, j;
+
+  G_LOCK (speller);
+
+  old = spell->priv->spellers;
+  spell->priv->spellers = g_ptr_array_sized_new (n_dicts);
+  for (i = 0; i < n_dicts; i++)
+    {
+      /* two tags may name the same dictionary */
+      for (j = 0; j < i && dicts[j] != dicts[i]; j++)
+        ;
+      if (j < i)
+        {
+          dict_pool_unref (dicts[i]);
+          continue;
+        }
+
+      sp = g_slice_new0 (Speller);
+      sp->dict = dicts[i];
+      enchant_dict_describe (sp->dict, set_lang_from_dict, sp);
+      sp->tag = g_intern_string (sp->lang);
+      sp->cache = word_cache_ref (sp->lang);
+      g_ptr_array_add (spell->priv->spellers, sp);
+    }
+
+  sp = g_ptr_array_index (spell->priv->spellers, 0);
+  spell->priv->speller = sp->dict;
+  spell->priv->word_cache = sp->cache;
+  g_free (spell->priv->lang);
+  spell->priv->lang = g_strdup (sp->lang);
+
+  /* the new tables are taken before the old ones are dropped, they may be
+   * the same */
+  spellers_free (old);
+  g_hash_table_remove_all (spell->priv->paragraph_langs);
+
+  G_UNLOCK (speller);
+}
+
+static void
+language_loaded (GtkSpellChecker *spell)
+{
+  /* results of checks still running are no longer valid */
+  check_jobs_invalidate (spell, NULL, NULL);
+  prefetch_cancel (spell);
+
+  if (!spell->priv->ready)
+    {
+      spell->priv->ready = TRUE;
+      g_signal_emit (spell, signals[READY], 0, NULL);
+    }
+}
+
+static gboolean
+set_language_internal (GtkSpellChecker *spell, const gchar *lang, GError **error)
+{
+  EnchantDict *dict;
+
+  lang = language_resolve (lang);
+
+  G_LOCK (broker);
+  dict = dict_pool_ref (lang);
+
+  if (!dict)
+    {
+      G_UNLOCK (broker);
+      g_set_error (error, GTK_SPELL_ERROR, GTK_SPELL_ERROR_BACKEND,
+                   _("enchant error for language: %s"), lang);
+      return FALSE;
+    }
+
+  set_language_dicts (spell, &dict, 1);
+  G_UNLOCK (broker);
+
+  /* a language change still loading in the background is superseded */
+  spell->priv->language_serial++;
+  language_loaded (spell);
+
+  return TRUE;
+}
+
+/* loading a dictionary in the background, for
+ * gtk_spell_checker_set_language_async */
+typedef struct _LanguageLoad LanguageLoad;
+struct _LanguageLoad
+{
+  gchar *lang;
+  EnchantDict *dict;
+  guint serial;
+};
+
+static void
+language_load_free (LanguageLoad *load)
+{
+  if (load->dict)
+    {
+      G_LOCK (broker);
+      dict_pool_unref (load->dict);
+      G_UNLOCK (broker);
+    }
+  g_free (load->lang);
+  g_slice_free (LanguageLoad, load);
+}
+
+static void
+language_load_thread (GTask *task, gpointer source, gpointer data,
+                      GCancellable *cancellable)
+{
+  LanguageLoad *load = data;
+
+  /* the main thread may need the broker lock meanwhile, e.g. to create
+   * another checker */
+  load->dict = dict_pool_ref_load (load->lang);
+
+  if (!load->dict)
+    g_task_return_new_error (task, GTK_SPELL_ERROR, GTK_SPELL_ERROR_BACKEND,
+                             _("enchant error for language: %s"), load->lang);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+language_load_ready (GObject *source, GAsyncResult *result, gpointer data)
+{
+  GtkSpellChecker *spell = GTK_SPELL_CHECKER (source);
+  GTask *task = data;
+  LanguageLoad *load = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &error))
+    g_task_return_error (task, error);
+  else if (g_task_return_error_if_cancelled (task))
+    ;
+  else if (load->serial != spell->priv->language_serial)
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                             _("The language was changed again"));
+  else
+    {
+      G_LOCK (broker);
+      set_language_dicts (spell, &load->dict, 1);
+      load->dict = NULL;
+      G_UNLOCK (broker);
+
+      language_loaded (spell);
+      gtk_spell_checker_recheck_all (spell);
+      g_task_return_boolean (task, TRUE);
+    }
+  g_object_unref (task);
+}
+
+static void
+set_progress (GtkSpellChecker *spell, gdouble progress)
+{
+  if (spell->priv->progress == progress)
+    return;
+  spell->priv->progress = progress;
+  g_object_notify (G_OBJECT (spell), "progress");
+}
+
+static gboolean
+get_visible_range (GtkSpellChecker *spell, GtkTextIter *start, GtkTextIter *end)
+{
+  GdkRectangle rect;
+
+  if (!spell->priv->view)
+    return FALSE;
+
+  gtk_text_view_get_visible_rect (spell->priv->view, &rect);
+  if (rect.height <= 0)
+    return FALSE;
+
+  gtk_text_view_get_line_at_y (spell->priv->view, start, rect.y, NULL);
+  gtk_text_view_get_line_at_y (spell->priv->view, end, rect.y + rect.height, NULL);
+  gtk_text_iter_forward_line (end);
+  return TRUE;
+}
+
+/* an incremental check keeps the region between mark_recheck_top and
+ * mark_recheck_bottom up to date and grows it in both directions. this
+ * makes sure the region covers the visible lines, which are checked right
+ * away: if the view was scrolled away from the region, the check restarts
+ * from the new viewport. */
+static void
+recheck_visible (GtkSpellChecker *spell)
+{
+  GtkTextBuffer *buffer = spell->priv->buffer;
+  GtkTextIter vstart, vend, top, bottom;
+
+  if (!get_visible_range (spell, &vstart, &vend))
+    return;
+
+  gtk_text_buffer_get_iter_at_mark (buffer, &top, spell->priv->mark_recheck_top);
+  gtk_text_buffer_get_iter_at_mark (buffer, &bottom, spell->priv->mark_recheck_bottom);
+
+  if (gtk_text_iter_compare (&vend, &top) < 0 ||
+      gtk_text_iter_compare (&vstart, &bottom) > 0)
+    {
+      check_range (spell, vstart, vend, TRUE);
+      gtk_text_buffer_move_mark (buffer, spell->priv->mark_recheck_top, &vstart);
+      gtk_text_buffer_move_mark (buffer, spell->priv->mark_recheck_bottom, &vend);
+      return;
+    }
+
+  if (gtk_text_iter_compare (&vstart, &top) < 0)
+    {
+      check_range (spell, vstart, top, TRUE);
+      gtk_text_buffer_move_mark (buffer, spell->priv->mark_recheck_top, &vstart);
+    }
+  if (gtk_text_iter_compare (&vend, &bottom) > 0)
+    {
+      check_range (spell, bottom, vend, TRUE);
+      gtk_text_buffer_move_mark (buffer, spell->priv->mark_recheck_bottom, &vend);
+    }
+}
+
+/* grows the checked region by a chunk of lines on either side until the time
+ * budget of this iteration is used up. edits made in the meantime are handled
+ * by the usual insert/delete handlers, the marks keep track of where to
+ * resume. */
+static gboolean
+recheck_step (gpointer data)
+{
+  GtkSpellChecker *spell = data;
+  GtkTextBuffer *buffer = spell->priv->buffer;
+  GtkTextIter top, bottom, iter;
+  gint64 deadline = g_get_monotonic_time () + RECHECK_BUDGET_USEC;
+  gint char_count;
+
+  /* the view may have been scrolled since the last iteration */
+  recheck_visible (spell);
+
+  gtk_text_buffer_get_iter_at_mark (buffer, &top, spell->priv->mark_recheck_top);
+  gtk_text_buffer_get_iter_at_mark (buffer, &bottom, spell->priv->mark_recheck_bottom);
+  while (!gtk_text_iter_is_start (&top) || !gtk_text_iter_is_end (&bottom))
+    {
+      if (!gtk_text_iter_is_end (&bottom))
+        {
+          iter = bottom;
+          gtk_text_iter_forward_lines (&iter, RECHECK_CHUNK_LINES);
+          check_range (spell, bottom, iter, TRUE);
+          bottom = iter;
+        }
+      if (!gtk_text_iter_is_start (&top))
+        {
+          iter = top;
+          gtk_text_iter_backward_lines (&iter, RECHECK_CHUNK_LINES);
+          check_range (spell, iter, top, TRUE);
+          top = iter;
+        }
+      if (g_get_monotonic_time () >= deadline)
+        break;
+    }
+  gtk_text_buffer_move_mark (buffer, spell->priv->mark_recheck_top, &top);
+  gtk_text_buffer_move_mark (buffer, spell->priv->mark_recheck_bottom, &bottom);
+
+  if (!gtk_text_iter_is_start (&top) || !gtk_text_iter_is_end (&bottom))
+    {
+      char_count = gtk_text_buffer_get_char_count (buffer);
+      set_progress (spell, (gdouble) (gtk_text_iter_get_offset (&bottom) -
+                                      gtk_text_iter_get_offset (&top)) /
+                           MAX (char_count, 1));
+      return G_SOURCE_CONTINUE;
+    }
+
+  spell->priv->recheck_source = 0;
+  set_progress (spell, 1.0);
+  g_signal_emit (spell, signals[CHECK_COMPLETE], 0);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+recheck_cancel (GtkSpellChecker *spell)
+{
+  if (spell->priv->recheck_source == 0)
+    return;
+
+  g_source_remove (spell->priv->recheck_source);
+  spell->priv->recheck_source = 0;
+  set_progress (spell, 1.0);
+}
+
+#if GTK_CHECK_VERSION(3,0,0)
+/* bring the lines scrolled into view up to date before they are drawn */
+static void
+view_scrolled (GtkAdjustment *adjustment, GtkSpellChecker *spell)
+{
+  if (spell->priv->recheck_source != 0)
+    recheck_visible (spell);
+}
+
+static void
+set_vadjustment (GtkSpellChecker *spell, GtkAdjustment *adjustment)
+{
+  if (spell->priv->vadjustment)
+    {
+      g_signal_handlers_disconnect_matched (spell->priv->vadjustment,
+                                            G_SIGNAL_MATCH_DATA,
+                                            0, 0, NULL, NULL, spell);
+      g_object_unref (spell->priv->vadjustment);
+    }
+
+  spell->priv->vadjustment = adjustment;
+
+  if (spell->priv->vadjustment)
+    {
+      g_object_ref (spell->priv->vadjustment);
+      g_signal_connect (spell->priv->vadjustment, "value-changed",
+                        G_CALLBACK (view_scrolled), spell);
+    }
+}
+
+static void
+vadjustment_changed (GtkTextView *view, GParamSpec *pspec, GtkSpellChecker *spell)
+{
+  g_return_if_fail (spell->priv->view == view);
+
+  set_vadjustment (spell, gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (view)));
+}
+#endif
+
+/* changes the buffer
+ * a NULL buffer is acceptable and will only release the current one */
+static void
+set_buffer (GtkSpellChecker *spell, GtkTextBuffer *buffer)
+{
+  GtkTextIter start, end;
+
+  recheck_cancel (spell);
+  prefetch_cancel (spell);
+
+  if (spell->priv->buffer)
+    {
+      g_signal_handlers_disconnect_matched (spell->priv->buffer, G_SIGNAL_MATCH_DATA,
+                                            0, 0, NULL, NULL, spell);
+
+      misspellings_clear (spell);
+      gtk_text_buffer_get_bounds (spell->priv->buffer, &start, &end);
+      gtk_text_buffer_remove_tag (spell->priv->buffer, spell->priv->tag_highlight,
+                                  &start, &end);
+      spell->priv->tag_highlight = NULL;
+
+      gtk_text_buffer_delete_mark (spell->priv->buffer, spell->priv->mark_insert_start);
+      spell->priv->mark_insert_start = NULL;
+      gtk_text_buffer_delete_mark (spell->priv->buffer, spell->priv->mark_insert_end);
+      spell->priv->mark_insert_end = NULL;
+      gtk_text_buffer_delete_mark (spell->priv->buffer, spell->priv->mark_click);
+      spell->priv->mark_click = NULL;
+      gtk_text_buffer_delete_mark (spell->priv->buffer, spell->priv->mark_recheck_top);
+      spell->priv->mark_recheck_top = NULL;
+      gtk_text_buffer_delete_mark (spell->priv->buffer, spell->priv->mark_recheck_bottom);
+      spell->priv->mark_recheck_bottom = NULL;
+
+      g_object_unref (spell->priv->buffer);
+    }
+
+  spell->priv->buffer = buffer;
 
   if (spell->priv->buffer)
     {
-      g_object_ref (spell->priv->buffer);
+      g_object_ref (spell->priv->buffer);
+
+      g_signal_connect (spell->priv->buffer, "insert-text",
+                        G_CALLBACK (insert_text_before), spell);
+      g_signal_connect_after (spell->priv->buffer, "insert-text",
+                        G_CALLBACK (insert_text_after), spell);
+      g_signal_connect (spell->priv->buffer, "delete-range",
+                        G_CALLBACK (delete_range_before), spell);
+      g_signal_connect_after (spell->priv->buffer, "delete-range",
+                        G_CALLBACK (delete_range_after), spell);
+      g_signal_connect (spell->priv->buffer, "mark-set",
+                        G_CALLBACK (mark_set), spell);
+
+      GtkTextTagTable *tagtable = gtk_text_buffer_get_tag_table (spell->priv->buffer);
+      spell->priv->tag_highlight = gtk_text_tag_table_lookup (tagtable,
+                                                     GTK_SPELL_MISSPELLED_TAG);
+
+      if (spell->priv->tag_highlight == NULL)
+        {
+          spell->priv->tag_highlight = gtk_text_buffer_create_tag (spell->priv->buffer,
+                                         GTK_SPELL_MISSPELLED_TAG, "underline",
+                                         PANGO_UNDERLINE_ERROR, NULL);
+        }
+
+      /* we create the mark here, but we don't use it until text is
+       * inserted, so we don't really care where iter points.  */
+      gtk_text_buffer_get_bounds (spell->priv->buffer, &start, &end);
+      spell->priv->mark_insert_start = gtk_text_buffer_create_mark (spell->priv->buffer,
+                                        "gtkspell-insert-start", &start, TRUE);
+      spell->priv->mark_insert_end = gtk_text_buffer_create_mark (spell->priv->buffer,
+                                          "gtkspell-insert-end", &start, TRUE);
+      spell->priv->mark_click = gtk_text_buffer_create_mark (spell->priv->buffer,
+                                               "gtkspell-click", &start, TRUE);
+      spell->priv->mark_recheck_top = gtk_text_buffer_create_mark (spell->priv->buffer,
+                                         "gtkspell-recheck-top", &start, TRUE);
+      spell->priv->mark_recheck_bottom = gtk_text_buffer_create_mark (spell->priv->buffer,
+                                      "gtkspell-recheck-bottom", &start, FALSE);
+
+      spell->priv->deferred_check = FALSE;
+
+      /* now check the entire text buffer. */
+      gtk_spell_checker_recheck_all (spell);
+    }
+}
+
+static void
+buffer_changed (GtkTextView *view, GParamSpec *pspec, GtkSpellChecker *spell)
+{
+  g_return_if_fail (spell->priv->view == view);
+
+  GtkTextBuffer *buf = gtk_text_view_get_buffer (view);
+  if (!buf)
+    gtk_spell_checker_detach (spell);
+  else
+    set_buffer (spell, buf);
+}
+
+static void
+gtk_spell_checker_set_property (GObject *object,
+                                guint propid,
+                                const GValue *value,
+                                GParamSpec *pspec)
+{
+  GtkSpellChecker *spell = GTK_SPELL_CHECKER (object);
+
+  switch (propid)
+    {
+    case PROP_DECODE_LANGUAGE_CODES:
+      spell->priv->decode_codes = g_value_get_boolean (value);
+      break;
+    case PROP_INCREMENTAL:
+      spell->priv->incremental = g_value_get_boolean (value);
+      break;
+    case PROP_THREADED:
+      spell->priv->threaded = g_value_get_boolean (value);
+      break;
+    case PROP_PREFETCH_SUGGESTIONS:
+      spell->priv->prefetch = g_value_get_boolean (value);
+      if (!spell->priv->prefetch)
+        prefetch_cancel (spell);
+      break;
+    case PROP_PRELOAD_LANGUAGES:
+      spell->priv->preload = g_value_get_boolean (value);
+      break;
+    case PROP_DEFERRED_LOAD:
+      spell->priv->deferred_load = g_value_get_boolean (value);
+      break;
+    case PROP_DETECT_LANGUAGE:
+      if (spell->priv->detect != g_value_get_boolean (value))
+        {
+          spell->priv->detect = g_value_get_boolean (value);
+          gtk_spell_checker_recheck_all (spell);
+        }
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, propid, pspec);
+      break;
+    }
+}
+
+static void
+gtk_spell_checker_get_property (GObject *object,
+                                guint propid,
+                                GValue *value,
+                                GParamSpec *pspec)
+{
+  GtkSpellChecker *spell = GTK_SPELL_CHECKER (object);
+
+  switch (propid)
+    {
+    case PROP_DECODE_LANGUAGE_CODES:
+      g_value_set_boolean (value, spell->priv->decode_codes);
+      break;
+    case PROP_INCREMENTAL:
+      g_value_set_boolean (value, spell->priv->incremental);
+      break;
+    case PROP_PROGRESS:
+      g_value_set_double (value, spell->priv->progress);
+      break;
+    case PROP_THREADED:
+      g_value_set_boolean (value, spell->priv->threaded);
+      break;
+    case PROP_PREFETCH_SUGGESTIONS:
+      g_value_set_boolean (value, spell->priv->prefetch);
+      break;
+    case PROP_PRELOAD_LANGUAGES:
+      g_value_set_boolean (value, spell->priv->preload);
+      break;
+    case PROP_DEFERRED_LOAD:
+      g_value_set_boolean (value, spell->priv->deferred_load);
+      break;
+    case PROP_DETECT_LANGUAGE:
+      g_value_set_boolean (value, spell->priv->detect);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, propid, pspec);
+      break;
+    }
+}
+
+static void
+gtk_spell_checker_class_init (GtkSpellCheckerClass *klass)
+{
+  g_type_class_add_private (klass, sizeof (GtkSpellCheckerPrivate));
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  object_class->dispose = gtk_spell_checker_dispose;
+  object_class->finalize = gtk_spell_checker_finalize;
+  object_class->set_property = gtk_spell_checker_set_property;
+  object_class->get_property = gtk_spell_checker_get_property;
+  object_class->constructed = gtk_spell_checker_constructed;
+
+  /**
+   * GtkSpellChecker::language-changed:
+   * @spell: the #GtkSpellChecker object which received the signal.
+   * @lang: the new language which was selected.
+   *
+   * The ::language-changed signal is emitted when the user selects
+   * a new spelling language from the context menu.
+   *
+   */
+  signals[LANGUAGE_CHANGED] = g_signal_new ("language-changed",
+                      G_OBJECT_CLASS_TYPE (object_class),
+                      G_SIGNAL_RUN_LAST,
+                      G_STRUCT_OFFSET (GtkSpellCheckerClass, language_changed),
+                      NULL, NULL,
+                      g_cclosure_marshal_VOID__STRING,
+                      G_TYPE_NONE,
+                      1,
+                      G_TYPE_STRING | G_SIGNAL_TYPE_STATIC_SCOPE);
+
+  /**
+   * GtkSpellChecker::check-complete:
+   * @spell: the #GtkSpellChecker object which received the signal.
+   *
+   * The ::check-complete signal is emitted when a check of the entire
+   * buffer, as started by gtk_spell_checker_recheck_all(), has finished.
+   *
+   * Since: 3.0.11
+   */
+  signals[CHECK_COMPLETE] = g_signal_new ("check-complete",
+                      G_OBJECT_CLASS_TYPE (object_class),
+                      G_SIGNAL_RUN_LAST,
+                      0,
+                      NULL, NULL,
+                      g_cclosure_marshal_VOID__VOID,
+                      G_TYPE_NONE,
+                      0);
+
+  /**
+   * GtkSpellChecker::ready:
+   * @spell: the #GtkSpellChecker object which received the signal.
+   * @error: (allow-none): the reason the dictionary could not be loaded,
+   *   or %NULL.
+   *
+   * The ::ready signal is emitted when the checker has loaded its first
+   * dictionary. A checker created with #GtkSpellChecker:deferred-load
+   * starts checking the text of its view then, and only then can words be
+   * checked or added to the dictionary.
+   *
+   * If the deferred load fails, the signal is emitted with @error set
+   * instead, and once more when a later language change succeeds.
+   *
+   * Since: 3.0.11
+   */
+  signals[READY] = g_signal_new ("ready",
+                      G_OBJECT_CLASS_TYPE (object_class),
+                      G_SIGNAL_RUN_LAST,
+                      0,
+                      NULL, NULL,
+                      g_cclosure_marshal_VOID__BOXED,
+                      G_TYPE_NONE,
+                      1,
+                      G_TYPE_ERROR | G_SIGNAL_TYPE_STATIC_SCOPE);
+
+  /**
+   * GtkSpellChecker::decode-language-codes:
+   *
+   * Whether to show decoded language codes in the context menu
+   * (requires the iso-codes package).
+   */
+  g_object_class_install_property (object_class, PROP_DECODE_LANGUAGE_CODES,
+        g_param_spec_boolean ("decode-language-codes",
+                              "Decode language codes",
+                              "Whether to show decoded language codes in the "\
+                              "context menu (requires the iso-codes package).",
+                              FALSE,
+                              G_PARAM_READWRITE));
+
+  /**
+   * GtkSpellChecker:incremental:
+   *
+   * Whether gtk_spell_checker_recheck_all() checks the buffer in small
+   * time-sliced chunks from an idle handler instead of all at once. The
+   * #GtkSpellChecker::check-complete signal is emitted once done.
+   *
+   * Since: 3.0.11
+   */
+  g_object_class_install_property (object_class, PROP_INCREMENTAL,
+        g_param_spec_boolean ("incremental",
+                              "Incremental",
+                              "Whether to recheck the buffer in the "\
+                              "background.",
+                              FALSE,
+                              G_PARAM_READWRITE));
+
+  /**
+   * GtkSpellChecker:progress:
+   *
+   * The fraction of the buffer which the running incremental check has
+   * processed so far, 1.0 if no check is running.
+   *
+   * Since: 3.0.11
+   */
+  g_object_class_install_property (object_class, PROP_PROGRESS,
+        g_param_spec_double ("progress",
+                             "Progress",
+                             "The fraction of the buffer which the running "\
+                             "incremental check has processed.",
+                             0.0, 1.0, 1.0,
+                             G_PARAM_READABLE));
+
+  /**
+   * GtkSpellChecker:threaded:
+   *
+   * Whether text typed or deleted by the user is checked in a worker
+   * thread, keeping the dictionary lookups off the main loop. Misspelled
+   * words are then highlighted shortly after the edit. Also, synchronous
+   * rechecks of large buffers are spread over all processors.
+   *
+   * Spreading a recheck loads another copy of each dictionary of the
+   * checker for every processor, which are kept as long as any dictionary
+   * is loaded, so that later rechecks don't load them again. This takes up
+   * to the size of the dictionaries times the number of processors in
+   * memory.
+   *
+   * Since: 3.0.11
+   */
+  g_object_class_install_property (object_class, PROP_THREADED,
+        g_param_spec_boolean ("threaded",
+                              "Threaded",
+                              "Whether to check edited text in a worker "\
+                              "thread.",
+                              FALSE,
+                              G_PARAM_READWRITE));
+
+  /**
+   * GtkSpellChecker:prefetch-suggestions:
+   *
+   * Whether to look up the suggestions for newly highlighted words near the
+   * cursor in the background, so that the context menu can show them right
+   * away. With #GtkSpellChecker:threaded set, the lookups use a second
+   * instance of the dictionary, so they don't hold up spell checking while
+   * the user types, at the cost of the memory that instance takes.
+   *
+   * Since: 3.0.11
+   */
+  g_object_class_install_property (object_class, PROP_PREFETCH_SUGGESTIONS,
+        g_param_spec_boolean ("prefetch-suggestions",
+                              "Prefetch suggestions",
+                              "Whether to look up suggestions for misspelled "\
+                              "words in the background.",
+                              FALSE,
+                              G_PARAM_READWRITE));
+
+  /**
+   * GtkSpellChecker:preload-languages:
+   *
+   * Whether to load the dictionaries listed in the Languages menu in the
+   * background while the menu is open, so that switching to one of them
+   * is quick. The dictionaries are kept within the limits set with
+   * gtk_spell_checker_set_dictionary_cache_limits().
+   *
+   * Since: 3.0.11
+   */
+  g_object_class_install_property (object_class, PROP_PRELOAD_LANGUAGES,
+        g_param_spec_boolean ("preload-languages",
+                              "Preload languages",
+                              "Whether to load the dictionaries in the "\
+                              "Languages menu in the background.",
+                              FALSE,
+                              G_PARAM_READWRITE));
+
+  /**
+   * GtkSpellChecker:deferred-load:
+   *
+   * Whether to load the dictionary of the default language in the
+   * background instead of during construction. The checker leaves the
+   * text alone until the dictionary is loaded, as signalled by
+   * #GtkSpellChecker::ready.
+   *
+   * Since: 3.0.11
+   */
+  g_object_class_install_property (object_class, PROP_DEFERRED_LOAD,
+        g_param_spec_boolean ("deferred-load",
+                              "Deferred load",
+                              "Whether to load the default dictionary in "\
+                              "the background.",
+                              FALSE,
+                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+  /**
+   * GtkSpellChecker:detect-language:
+   *
+   * Whether to check each paragraph with the one of the languages set
+   * with gtk_spell_checker_set_languages() that fits it best, instead of
+   * accepting a word in any of them. A paragraph's language is the one
+   * that accepts the most of its first words, and is remembered until an
+   * edit changes those words, which rechecks the whole paragraph if its
+   * language changes. Paragraphs none of the languages fit are checked
+   * with all of them.
+   *
+   * Since: 3.0.11
+   */
+  g_object_class_install_property (object_class, PROP_DETECT_LANGUAGE,
+        g_param_spec_boolean ("detect-language",
+                              "Detect language",
+                              "Whether to check each paragraph in the "\
+                              "language detected for it.",
+                              FALSE,
+                              G_PARAM_READWRITE));
+}
+
+static void
+gtk_spell_checker_init (GtkSpellChecker *self)
+{
+  self->priv = GTK_SPELL_CHECKER_GET_PRIVATE (self);
+  self->priv->view = NULL;
+  self->priv->buffer = NULL;
+  self->priv->tag_highlight = NULL;
+  self->priv->mark_insert_start = NULL;
+  self->priv->mark_insert_end = NULL;
+  self->priv->mark_click = NULL;
+  self->priv->mark_recheck_top = NULL;
+  self->priv->mark_recheck_bottom = NULL;
+  self->priv->misspellings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                    (GDestroyNotify) g_queue_free);
+  self->priv->misspelling_ranges = g_sequence_new (NULL);
+  self->priv->vadjustment = NULL;
+  self->priv->deferred_check = FALSE;
+  self->priv->incremental = FALSE;
+  self->priv->recheck_source = 0;
+  self->priv->progress = 1.0;
+  self->priv->threaded = FALSE;
+  self->priv->check_pool = NULL;
+  self->priv->prefetch = FALSE;
+  self->priv->prefetch_queue = g_queue_new ();
+  self->priv->prefetch_source = 0;
+  self->priv->prefetch_cancellable = NULL;
+  self->priv->preload = FALSE;
+  self->priv->preload_cancellable = NULL;
+  self->priv->check_jobs = g_queue_new ();
+  self->priv->deferred_load = FALSE;
+  self->priv->ready = FALSE;
+  self->priv->language_serial = 0;
+  self->priv->spellers = NULL;
+  self->priv->detect = FALSE;
+  self->priv->paragraph_langs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       g_free, NULL);
+  self->priv->edit_sample = NULL;
+  self->priv->speller = NULL;
+  self->priv->word_cache = NULL;
+  self->priv->lang = NULL;
+
+#ifdef ENABLE_NLS
+  bindtextdomain (PACKAGE_NAME, PACKAGE_LOCALE_DIR);
+  bind_textdomain_codeset (PACKAGE_NAME, "UTF-8");
+#endif
+
+  G_LOCK (broker);
+  broker_acquire ();
+  G_UNLOCK (broker);
+}
+
+static void
+deferred_load_ready (GObject *source, GAsyncResult *result, gpointer data)
+{
+  GtkSpellChecker *spell = GTK_SPELL_CHECKER (source);
+  GError *error = NULL;
+
+  /* a language change which superseded the load reports readiness itself */
+  if (!gtk_spell_checker_set_language_finish (spell, result, &error) &&
+      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+      !spell->priv->ready)
+    g_signal_emit (spell, signals[READY], 0, error);
+  g_clear_error (&error);
+}
+
+static void
+gtk_spell_checker_constructed (GObject *object)
+{
+  GtkSpellChecker *spell = GTK_SPELL_CHECKER (object);
+
+  if (G_OBJECT_CLASS (gtk_spell_checker_parent_class)->constructed)
+    G_OBJECT_CLASS (gtk_spell_checker_parent_class)->constructed (object);
+
+  if (spell->priv->deferred_load)
+    gtk_spell_checker_set_language_async (spell, NULL, NULL, deferred_load_ready, NULL);
+  else
+    set_language_internal (spell, NULL, NULL);
+}
+
+static void
+gtk_spell_checker_dispose (GObject *object)
+{
+  GtkSpellChecker *spell = GTK_SPELL_CHECKER (object);
+
+  gtk_spell_checker_detach (spell);
+
+  G_INITIALLY_UNOWNED_CLASS (gtk_spell_checker_parent_class)->dispose (object);
+}
+
+static void
+gtk_spell_checker_finalize (GObject *object)
+{
+  GtkSpellChecker *spell = GTK_SPELL_CHECKER (object);
+
+  /* pending jobs hold a reference, so the pool is idle by now */
+  if (spell->priv->check_pool)
+    g_thread_pool_free (spell->priv->check_pool, FALSE, TRUE);
+
+  g_hash_table_destroy (spell->priv->misspellings);
+  g_hash_table_destroy (spell->priv->paragraph_langs);
+  g_free (spell->priv->edit_sample);
+  g_queue_free (spell->priv->check_jobs);
+  prefetch_cancel (spell);
+  g_queue_free (spell->priv->prefetch_queue);
+  g_clear_object (&spell->priv->preload_cancellable);
+  g_sequence_free (spell->priv->misspelling_ranges);
+
+  G_LOCK (broker);
+  if (broker)
+    {
+      G_LOCK (speller);
+      spellers_free (spell->priv->spellers);
+      G_UNLOCK (speller);
+      broker_release ();
+    }
+  G_UNLOCK (broker);
+
+  g_free (spell->priv->lang);
+
+  G_INITIALLY_UNOWNED_CLASS (gtk_spell_checker_parent_class)->finalize (object);
+}
+
+/**
+ * gtk_spell_checker_new:
+ *
+ * Create a new #GtkSpellChecker object.
+ *
+ * Returns: a new #GtkSpellChecker object.
+ */
+GtkSpellChecker*
+gtk_spell_checker_new (void)
+{
+  return g_object_new (GTK_SPELL_TYPE_CHECKER, NULL);
+}
+
+/**
+ * gtk_spell_checker_attach:
+ * @spell: A #GtkSpellChecker.
+ * @view: The #GtkTextView to attach to.
+ *
+ * Attach #GtkSpellChecker object to @view.
+ *
+ * Note: Please read the tutorial section of the documentation to make sure
+ * you don't leak references!
+ *
+ * Returns: TRUE on success, FALSE on failure.
+ */
+gboolean
+gtk_spell_checker_attach (GtkSpellChecker *spell, GtkTextView *view)
+{
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), FALSE);
+  g_return_val_if_fail (GTK_IS_TEXT_VIEW (view), FALSE);
+  g_return_val_if_fail (gtk_text_view_get_buffer (view), FALSE);
+  g_return_val_if_fail (spell->priv->view == NULL, FALSE);
+
+  /* ensure no existing instance is attached */
+  GtkSpellChecker *attached;
+  attached = g_object_get_data (G_OBJECT (view), GTK_SPELL_OBJECT_KEY);
+  g_return_val_if_fail (attached == NULL, FALSE);
+
+  /* attach to the widget */
+  spell->priv->view = view;
+  g_object_ref (view);
+  g_object_ref_sink (spell);
+
+  g_object_set_data (G_OBJECT (view), GTK_SPELL_OBJECT_KEY, spell);
+
+  g_signal_connect_swapped (view, "destroy",
+                            G_CALLBACK (gtk_spell_checker_detach), spell);
+  g_signal_connect (view, "button-press-event",
+                    G_CALLBACK (button_press_event), spell);
+  g_signal_connect (view, "populate-popup",
+                    G_CALLBACK (populate_popup), spell);
+  g_signal_connect (view, "popup-menu",
+                    G_CALLBACK (popup_menu_event), spell);
+  g_signal_connect (view, "notify::buffer",
+                    G_CALLBACK (buffer_changed), spell);
+#if GTK_CHECK_VERSION(3,0,0)
+  g_signal_connect (view, "notify::vadjustment",
+                    G_CALLBACK (vadjustment_changed), spell);
+  set_vadjustment (spell, gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (view)));
+#endif
+
+  set_buffer (spell, gtk_text_view_get_buffer (view));
+
+  return TRUE;
+}
+
+/**
+ * gtk_spell_checker_detach:
+ * @spell: A #GtkSpellChecker.
+ *
+ * Detaches this #GtkSpellChecker from its #GtkTextView.  Use
+ * gtk_spell_checker_get_from_text_view () to retrieve a #GtkSpellChecker from
+ * a #GtkTextView. If the #GtkSpellChecker is not attached to any #GtkTextView,
+ * the function silently exits.
+ *
+ * Note: if the #GtkSpellChecker is owned by the #GtkTextView, you must
+ * take a reference to it to prevent it from being automatically destroyed.
+ * Please read the tutorial section of the documentation!
+ */
+void
+gtk_spell_checker_detach (GtkSpellChecker *spell)
+{
+  g_return_if_fail (GTK_SPELL_IS_CHECKER (spell));
+  if (spell->priv->view == NULL)
+    return;
+
+  g_signal_handlers_disconnect_matched (spell->priv->view, G_SIGNAL_MATCH_DATA,
+        0, 0, NULL, NULL, spell);
+
+  g_object_set_data (G_OBJECT (spell->priv->view), GTK_SPELL_OBJECT_KEY, NULL);
+
+#if GTK_CHECK_VERSION(3,0,0)
+  set_vadjustment (spell, NULL);
+#endif
+  g_object_unref (spell->priv->view);
+  spell->priv->view = NULL;
+  set_buffer (spell, NULL);
+  spell->priv->deferred_check = FALSE;
+  g_object_unref (spell);
+}
+
+/**
+ * gtk_spell_checker_get_from_text_view:
+ * @view: A #GtkTextView.
+ *
+ * Retrieves the #GtkSpellChecker object attached to a text view.
+ *
+ * Returns: (transfer none): the #GtkSpellChecker object, or %NULL if there is no #GtkSpellChecker
+ * attached to @view.
+ */
+GtkSpellChecker*
+gtk_spell_checker_get_from_text_view (GtkTextView *view)
+{
+  g_return_val_if_fail (GTK_IS_TEXT_VIEW (view), NULL);
+  return g_object_get_data (G_OBJECT (view), GTK_SPELL_OBJECT_KEY);
+}
+
+/**
+ * gtk_spell_checker_get_language:
+ * @spell: a #GtkSpellChecker
+ *
+ * Fetches the current language.
+ *
+ * Returns: the current language. This string is
+ * owned by the spell object and must not be modified or freed.
+ **/
+const gchar*
+gtk_spell_checker_get_language (GtkSpellChecker *spell)
+{
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), NULL);
+
+  return spell->priv->lang;
+}
+
+/**
+ * gtk_spell_checker_get_language_list:
+ *
+ * Requests the list of available languages from the enchant broker.
+ *
+ * Returns: (transfer full) (element-type utf8): a #GList of the available languages.
+ * Use g_list_free_full with g_free to free the list after use.
+ *
+ * Since: 3.0.3
+ */
+GList*
+gtk_spell_checker_get_language_list (void)
+{
+  GPtrArray *langs;
+  GList *result = NULL;
+  guint i;
+
+  G_LOCK (broker);
+  broker_acquire ();
+
+  langs = languages_get ();
+  for (i = langs->len; i > 0; i--)
+    result = g_list_prepend (result,
+                             g_strdup (((Language *) g_ptr_array_index (langs, i - 1))->tag));
+
+  broker_release ();
+  G_UNLOCK (broker);
+
+  return result;
+}
+
+static void
+language_list_free (GList *langs)
+{
+  g_list_free_full (langs, g_free);
+}
+
+static void
+get_language_list_thread (GTask *task, gpointer source, gpointer data,
+                          GCancellable *cancellable)
+{
+  g_task_return_pointer (task, gtk_spell_checker_get_language_list (),
+                         (GDestroyNotify) language_list_free);
+}
+
+/**
+ * gtk_spell_checker_get_language_list_async:
+ * @cancellable: (allow-none): A #GCancellable, or %NULL.
+ * @callback: (scope async): The callback to call when the list is ready.
+ * @user_data: (closure): The data to pass to @callback.
+ *
+ * Requests the list of available languages from the enchant broker in a
+ * worker thread, loading the provider modules when no checker did yet.
+ * The broker is kept for a while after the last checker is gone, so
+ * that repeated requests don't load the providers over and over. Call
+ * gtk_spell_checker_get_language_list_finish() from @callback to get the
+ * result.
+ *
+ * Since: 3.0.11
+ */
+void
+gtk_spell_checker_get_language_list_async (GCancellable *cancellable,
+                                           GAsyncReadyCallback callback,
+                                           gpointer user_data)
+{
+  GTask *task;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gtk_spell_checker_get_language_list_async);
+  g_task_run_in_thread (task, get_language_list_thread);
+  g_object_unref (task);
+}
+
+/**
+ * gtk_spell_checker_get_language_list_finish:
+ * @result: The #GAsyncResult passed to the callback.
+ * @error: (allow-none): Return location for error, or %NULL.
+ *
+ * Finishes a request started with
+ * gtk_spell_checker_get_language_list_async().
+ *
+ * Returns: (transfer full) (element-type utf8): a #GList of the available
+ * languages. Use g_list_free_full with g_free to free the list after use.
+ *
+ * Since: 3.0.11
+ */
+GList*
+gtk_spell_checker_get_language_list_finish (GAsyncResult *result,
+                                            GError **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * gtk_spell_checker_set_dictionary_cache_limits:
+ * @max_dictionaries: The number of unused dictionaries to keep loaded.
+ * @max_bytes: The estimated memory the unused dictionaries may take.
+ *
+ * Dictionaries no checker uses any longer are kept loaded, so that
+ * switching back to a recently used language doesn't load it from disk
+ * again. The least recently used ones are dropped once there are more than
+ * @max_dictionaries of them, or once they take more than @max_bytes. Pass
+ * 0 for @max_dictionaries to drop unused dictionaries right away.
+ *
+ * The defaults are 4 dictionaries and 64 MiB.
+ *
+ * Since: 3.0.11
+ */
+void
+gtk_spell_checker_set_dictionary_cache_limits (guint max_dictionaries,
+                                               gsize max_bytes)
+{
+  G_LOCK (broker);
+  dict_warm_max = max_dictionaries;
+  dict_warm_budget = max_bytes;
+  if (broker)
+    dict_pool_trim (dict_warm_max, dict_warm_budget);
+  G_UNLOCK (broker);
+}
+
+/**
+ * gtk_spell_checker_get_cache_statistics:
+ * @hits: (out) (allow-none): Return location for the number of checks
+ *   answered from the cache, or %NULL.
+ * @misses: (out) (allow-none): Return location for the number of checks
+ *   the backend was asked for, or %NULL.
+ * @evictions: (out) (allow-none): Return location for the number of
+ *   verdicts dropped to make room for others, or %NULL.
+ *
+ * Retrieves how well the process-wide cache of spell checking verdicts
+ * has done so far. The counts cover all the checkers of the process.
+ *
+ * Since: 3.0.11
+ */
+void
+gtk_spell_checker_get_cache_statistics (guint *hits, guint *misses,
+                                        guint *evictions)
+{
+  G_LOCK (speller);
+  if (hits)
+    *hits = word_cache_hits;
+  if (misses)
+    *misses = word_cache_misses;
+  if (evictions)
+    *evictions = word_cache_evictions;
+  G_UNLOCK (speller);
+}
+
+/**
+ * gtk_spell_checker_decode_language_code:
+ * @lang: The language locale specifier (i.e. "en_US").
+ *
+ * Translates the language code to a human readable format
+ * (i.e. "en_US" -> "English (United States)").
+ * Note: If the iso-codes package is not available, the unchanged code is
+ * returned.
+ *
+ * Returns: (transfer full): The translated language specifier. Use g_free to
+ * free the returned string after use.
+ *
+ * Since: 3.0.3
+ */
+gchar*
+gtk_spell_checker_decode_language_code (const gchar *lang)
+{
+  gchar* result;
+#ifdef HAVE_ISO_CODES
+  result = language_label (lang);
+#else
+  result = g_strdup (lang);
+#endif
+  return result;
+}
+
+/**
+ * gtk_spell_checker_set_language:
+ * @spell: The #GtkSpellChecker object.
+ * @lang: (allow-none): The language to use, as a locale specifier (i.e. "en_US").
+ * If #NULL, attempt to use the default system locale (LANG).
+ * @error: (out) (allow-none): Return location for error.
+ *
+ * Set the language on @spell to @lang, possibily returning an error in
+ * @error.
+ *
+ * Returns: FALSE if there was an error.
+ */
+gboolean
+gtk_spell_checker_set_language (GtkSpellChecker *spell, const gchar *lang, GError **error)
+{
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), FALSE);
+
+  if (error)
+    g_return_val_if_fail (*error == NULL, FALSE);
+
+  gboolean ret = set_language_internal (spell, lang, error);
+  if (ret)
+    gtk_spell_checker_recheck_all (spell);
+
+  return ret;
+}
+
+/**
+ * gtk_spell_checker_set_language_async:
+ * @spell: The #GtkSpellChecker object.
+ * @lang: (allow-none): The language to use, as a locale specifier (i.e. "en_US").
+ * If #NULL, attempt to use the default system locale (LANG).
+ * @cancellable: (allow-none): A #GCancellable, or %NULL.
+ * @callback: (scope async): The callback to call when the language is set.
+ * @user_data: (closure): The data to pass to @callback.
+ *
+ * Like gtk_spell_checker_set_language(), but loads the dictionary in a
+ * worker thread. The checker keeps using the previous language until the
+ * new one is loaded, then rechecks the buffer. A later language change
+ * supersedes a pending one, which then fails with %G_IO_ERROR_CANCELLED.
+ * Call gtk_spell_checker_set_language_finish() from @callback to get the
+ * result.
+ *
+ * Since: 3.0.11
+ */
+void
+gtk_spell_checker_set_language_async (GtkSpellChecker *spell,
+                                      const gchar *lang,
+                                      GCancellable *cancellable,
+                                      GAsyncReadyCallback callback,
+                                      gpointer user_data)
+{
+  g_return_if_fail (GTK_SPELL_IS_CHECKER (spell));
+
+  GTask *task, *loader;
+  LanguageLoad *load;
+
+  task = g_task_new (spell, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gtk_spell_checker_set_language_async);
+
+  load = g_slice_new0 (LanguageLoad);
+  load->lang = g_strdup (language_resolve (lang));
+  load->serial = ++spell->priv->language_serial;
+  g_task_set_task_data (task, load, (GDestroyNotify) language_load_free);
+
+  /* the dictionary is put to use back in the main context, before the
+   * caller learns of it */
+  loader = g_task_new (spell, NULL, language_load_ready, task);
+  g_task_set_task_data (loader, load, NULL);
+  g_task_run_in_thread (loader, language_load_thread);
+  g_object_unref (loader);
+}
+
+/**
+ * gtk_spell_checker_set_language_finish:
+ * @spell: The #GtkSpellChecker object.
+ * @result: The #GAsyncResult passed to the callback.
+ * @error: (allow-none): Return location for error, or %NULL.
+ *
+ * Finishes a language change started with
+ * gtk_spell_checker_set_language_async().
+ *
+ * Returns: FALSE if there was an error.
+ *
+ * Since: 3.0.11
+ */
+gboolean
+gtk_spell_checker_set_language_finish (GtkSpellChecker *spell,
+                                       GAsyncResult *result,
+                                       GError **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, spell), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * gtk_spell_checker_set_languages:
+ * @spell: The #GtkSpellChecker object.
+ * @langs: (array zero-terminated=1): The languages to use, as locale
+ * specifiers (i.e. "en_US").
+ * @error: (out) (allow-none): Return location for error.
+ *
+ * Set the languages to check text with, for text that mixes them. A word
+ * is correct if one of the languages accepts it. The languages are asked
+ * in the order of how many words they accepted so far, so that most words
+ * take a single lookup. Words added to the dictionary or ignored go to the
+ * first of @langs, which is also the one gtk_spell_checker_get_language()
+ * returns and suggestions come from.
+ *
+ * If an error is returned, the checker keeps its languages.
+ *
+ * Returns: FALSE if there was an error.
+ *
+ * Since: 3.0.11
+ */
+gboolean
+gtk_spell_checker_set_languages (GtkSpellChecker *spell,
+                                 const gchar * const *langs,
+                                 GError **error)
+{
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), FALSE);
+  g_return_val_if_fail (langs != NULL && langs[0] != NULL, FALSE);
+
+  if (error)
+    g_return_val_if_fail (*error == NULL, FALSE);
+
+  EnchantDict **dicts;
+  guint i, n_dicts;
+
+  n_dicts = g_strv_length ((gchar **) langs);
+  dicts = g_new (EnchantDict *, n_dicts);
+
+  G_LOCK (broker);
+  for (i = 0; i < n_dicts; i++)
+    {
+      dicts[i] = dict_pool_ref (langs[i]);
+      if (!dicts[i])
+        {
+          g_set_error (error, GTK_SPELL_ERROR, GTK_SPELL_ERROR_BACKEND,
+                       _("enchant error for language: %s"), langs[i]);
+          while (i-- > 0)
+            dict_pool_unref (dicts[i]);
+          G_UNLOCK (broker);
+          g_free (dicts);
+          return FALSE;
+        }
+    }
+  set_language_dicts (spell, dicts, n_dicts);
+  G_UNLOCK (broker);
+  g_free (dicts);
+
+  spell->priv->language_serial++;
+  language_loaded (spell);
+  gtk_spell_checker_recheck_all (spell);
+
+  return TRUE;
+}
+
+/**
+ * gtk_spell_checker_get_languages:
+ * @spell: The #GtkSpellChecker object.
+ *
+ * Fetches the languages the checker uses, as set with
+ * gtk_spell_checker_set_languages(). The first is the language words are
+ * added to, the others follow in the order they are asked in.
+ *
+ * Returns: (transfer full) (array zero-terminated=1): the languages, or
+ * %NULL if the checker has none yet. Use g_strfreev() to free them.
+ *
+ * Since: 3.0.11
+ */
+gchar **
+gtk_spell_checker_get_languages (GtkSpellChecker *spell)
+{
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), NULL);
+
+  GPtrArray *spellers;
+  gchar **langs;
+  guint i, n = 0;
+
+  G_LOCK (speller);
+  spellers = spell->priv->spellers;
+  if (!spellers)
+    {
+      G_UNLOCK (speller);
+      return NULL;
+    }
+
+  langs = g_new0 (gchar *, spellers->len + 1);
+  langs[n++] = g_strdup (spell->priv->lang);
+  for (i = 0; i < spellers->len; i++)
+    {
+      Speller *sp = g_ptr_array_index (spellers, i);
+      if (sp->dict != spell->priv->speller)
+        langs[n++] = g_strdup (sp->lang);
+    }
+  G_UNLOCK (speller);
+
+  return langs;
+}
+
+/**
+ * gtk_spell_checker_check_word:
+ * @spell: The #GtkSpellChecker object.
+ * @word: The word to check.
+ *
+ * Check the specified word. A checker created with
+ * #GtkSpellChecker:deferred-load can only check words once it has emitted
+ * #GtkSpellChecker::ready.
+ *
+ * Returns: TRUE if the word is correctly spelled, FALSE otherwise.
+ *
+ * Since: 3.0.8
+ */
+gboolean
+gtk_spell_checker_check_word (GtkSpellChecker *spell, const gchar *word)
+{
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), FALSE);
+  g_return_val_if_fail (word != NULL, FALSE);
+  g_return_val_if_fail (spell->priv->speller != NULL, FALSE);
 
-      g_signal_connect (spell->priv->buffer, "insert-text",
-                        G_CALLBACK (insert_text_before), spell);
-      g_signal_connect_after (spell->priv->buffer, "insert-text",
-                        G_CALLBACK (insert_text_after), spell);
-      g_signal_connect_after (spell->priv->buffer, "delete-range",
-                        G_CALLBACK (delete_range_after), spell);
-      g_signal_connect (spell->priv->buffer, "mark-set",
-                        G_CALLBACK (mark_set), spell);
+  if (g_unichar_isdigit (*word) == TRUE || /* don't check numbers */
+      word_is_correct (spell, NULL, word, strlen (word)))
+    return TRUE;
+  return FALSE;
+}
 
-      GtkTextTagTable *tagtable = gtk_text_buffer_get_tag_table (spell->priv->buffer);
-      spell->priv->tag_highlight = gtk_text_tag_table_lookup (tagtable,
-                                                     GTK_SPELL_MISSPELLED_TAG);
+/* the verdict of the batch functions on @word, which is nul-terminated.
+ * called with the speller lock held. */
+static gboolean
+batch_word_is_correct (GtkSpellChecker *spell, const gchar *word, gsize len)
+{
+  if (len == 0)
+    return TRUE;
+  if (!g_utf8_validate (word, len, NULL))
+    return FALSE;
+  if (g_unichar_isdigit (g_utf8_get_char (word))) /* don't check numbers */
+    return TRUE;
+  return word_is_correct_locked (spell, NULL, word, len);
+}
 
-      if (spell->priv->tag_highlight == NULL)
-        {
-          spell->priv->tag_highlight = gtk_text_buffer_create_tag (spell->priv->buffer,
-                                         GTK_SPELL_MISSPELLED_TAG, "underline",
-                                         PANGO_UNDERLINE_ERROR, NULL);
-        }
+/**
+ * gtk_spell_checker_check_words:
+ * @spell: The #GtkSpellChecker object.
+ * @words: (array zero-terminated=1): The words to check.
+ *
+ * Checks several words at once, like gtk_spell_checker_check_word() does
+ * one. Bindings save a call per word this way. Empty words count as
+ * correctly spelled, words that aren't valid UTF-8 as misspelled. Like
+ * gtk_spell_checker_check_word(), this needs the checker to be ready.
+ *
+ * Returns: (transfer full) (element-type gboolean): for each of @words,
+ * TRUE if it is correctly spelled. Use g_array_unref to free the array
+ * after use.
+ *
+ * Since: 3.0.11
+ */
+GArray *
+gtk_spell_checker_check_words (GtkSpellChecker *spell,
+                               const gchar * const *words)
+{
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), NULL);
+  g_return_val_if_fail (words != NULL, NULL);
+  g_return_val_if_fail (spell->priv->speller != NULL, NULL);
 
-      /* we create the mark here, but we don't use it until text is
-       * inserted, so we don't really care where iter points.  */
-      gtk_text_buffer_get_bounds (spell->priv->buffer, &start, &end);
-      spell->priv->mark_insert_start = gtk_text_buffer_create_mark (spell->priv->buffer,
-                                        "gtkspell-insert-start", &start, TRUE);
-      spell->priv->mark_insert_end = gtk_text_buffer_create_mark (spell->priv->buffer,
-                                          "gtkspell-insert-end", &start, TRUE);
-      spell->priv->mark_click = gtk_text_buffer_create_mark (spell->priv->buffer,
-                                               "gtkspell-click", &start, TRUE);
+  GArray *results;
+  gboolean correct;
+  guint i, n_words;
 
-      spell->priv->deferred_check = FALSE;
+  n_words = g_strv_length ((gchar **) words);
+  results = g_array_sized_new (FALSE, FALSE, sizeof (gboolean), n_words);
 
-      /* now check the entire text buffer. */
-      gtk_spell_checker_recheck_all (spell);
+  G_LOCK (speller);
+  for (i = 0; i < n_words; i++)
+    {
+      correct = batch_word_is_correct (spell, words[i], strlen (words[i]));
+      g_array_append_val (results, correct);
     }
+  G_UNLOCK (speller);
+
+  return results;
 }
 
-static void
-buffer_changed (GtkTextView *view, GParamSpec *pspec, GtkSpellChecker *spell)
+/**
+ * gtk_spell_checker_check_words_packed:
+ * @spell: The #GtkSpellChecker object.
+ * @buffer: (array length=length) (element-type guint8): The words to
+ * check, one after the other in UTF-8.
+ * @length: The length of @buffer in bytes.
+ * @offsets: (array length=n_offsets): The byte offsets in @buffer at
+ * which the words start, followed by the offset at which the last ends.
+ * @n_offsets: The number of @offsets, one more than the number of words.
+ *
+ * Like gtk_spell_checker_check_words(), for words packed into a single
+ * buffer, which saves bindings from converting each of them to a string.
+ * Word i is the bytes from @offsets[i] up to @offsets[i + 1].
+ *
+ * Returns: (transfer full) (element-type gboolean): for each word, TRUE if
+ * it is correctly spelled, or %NULL if @offsets decrease or go past the
+ * end of @buffer. Use g_array_unref to free the array after use.
+ *
+ * Since: 3.0.11
+ */
+GArray *
+gtk_spell_checker_check_words_packed (GtkSpellChecker *spell,
+                                      const gchar *buffer,
+                                      gsize length,
+                                      const guint *offsets,
+                                      gsize n_offsets)
 {
-  g_return_if_fail (spell->priv->view == view);
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), NULL);
+  g_return_val_if_fail (buffer != NULL || length == 0, NULL);
+  g_return_val_if_fail (offsets != NULL || n_offsets == 0, NULL);
+  g_return_val_if_fail (spell->priv->speller != NULL, NULL);
+
+  GArray *results;
+  GString *word;
+  gboolean correct;
+  gsize i;
+
+  /* check the offsets first, so that the verdicts can't end up out of
+   * step with the words */
+  for (i = 0; i < n_offsets; i++)
+    g_return_val_if_fail (offsets[i] <= length &&
+                          (i == 0 || offsets[i - 1] <= offsets[i]), NULL);
+
+  results = g_array_sized_new (FALSE, FALSE, sizeof (gboolean),
+                               n_offsets > 0 ? n_offsets - 1 : 0);
+
+  /* the words are copied out one by one to terminate them */
+  word = g_string_new (NULL);
+  G_LOCK (speller);
+  for (i = 0; i + 1 < n_offsets; i++)
+    {
+      g_string_truncate (word, 0);
+      g_string_append_len (word, buffer + offsets[i], offsets[i + 1] - offsets[i]);
+      correct = batch_word_is_correct (spell, word->str, word->len);
+      g_array_append_val (results, correct);
+    }
+  G_UNLOCK (speller);
+  g_string_free (word, TRUE);
 
-  GtkTextBuffer *buf = gtk_text_view_get_buffer (view);
-  if (!buf)
-    gtk_spell_checker_detach (spell);
-  else
-    set_buffer (spell, buf);
+  return results;
 }
 
+/* pango_find_paragraph_boundary, for texts of any length which need not
+ * be nul-terminated */
 static void
-gtk_spell_checker_set_property (GObject *object,
-                                guint propid,
-                                const GValue *value,
-                                GParamSpec *pspec)
+find_paragraph_boundary (const gchar *text, gsize len,
+                         gsize *delimiter, gsize *next)
 {
-  GtkSpellChecker *spell = GTK_SPELL_CHECKER (object);
+  gsize i;
 
-  switch (propid)
+  for (i = 0; i < len; i++)
     {
-    case PROP_DECODE_LANGUAGE_CODES:
-      spell->priv->decode_codes = g_value_get_boolean (value);
-      break;
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, propid, pspec);
-      break;
+      if (text[i] == '\n')
+        {
+          *delimiter = i;
+          *next = i + 1;
+          return;
+        }
+      if (text[i] == '\r')
+        {
+          *delimiter = i;
+          *next = i + 1 < len && text[i + 1] == '\n' ? i + 2 : i + 1;
+          return;
+        }
+      /* U+2029, the paragraph separator */
+      if ((guchar) text[i] == 0xe2 && i + 2 < len &&
+          (guchar) text[i + 1] == 0x80 && (guchar) text[i + 2] == 0xa9)
+        {
+          *delimiter = i;
+          *next = i + 3;
+          return;
+        }
     }
+
+  *delimiter = *next = len;
 }
 
-static void
-gtk_spell_checker_get_property (GObject *object,
-                                guint propid,
-                                GValue *value,
-                                GParamSpec *pspec)
-{
-  GtkSpellChecker *spell = GTK_SPELL_CHECKER (object);
+/* checks @text of @len bytes, which is valid UTF-8, the way check_range
+ * does, and calls @func with each misspelled word until it returns FALSE.
+ * the words are copied out one by one to terminate them for the caches.
+ * returns FALSE if @func stopped. */
+typedef gboolean (*CheckTextFunc) (const gchar *word, gsize offset, gsize len,
+                                   gpointer data);
 
-  switch (propid)
+static gboolean
+check_text (GtkSpellChecker *spell, const gchar *text, gsize len,
+            CheckTextFunc func, gpointer data)
+{
+  SegmentIter words;
+  SegmentWord word;
+  const gchar *tag, *paragraph;
+  gsize delimiter, next;
+  GString *w;
+  gboolean more = TRUE;
+
+  w = g_string_new (NULL);
+  for (paragraph = text; more && paragraph < text + len; paragraph += next)
     {
-    case PROP_DECODE_LANGUAGE_CODES:
-      g_value_set_boolean (value, spell->priv->decode_codes);
-      break;
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, propid, pspec);
-      break;
+      find_paragraph_boundary (paragraph, text + len - paragraph, &delimiter, &next);
+      tag = paragraph_language (spell, paragraph, delimiter);
+
+      segment_iter_init (&words, paragraph, delimiter);
+      while (more && segment_iter_next (&words, &word))
+        {
+          g_string_truncate (w, 0);
+          g_string_append_len (w, paragraph + word.byte_start,
+                               word.byte_end - word.byte_start);
+          if (g_unichar_isdigit (*w->str) == FALSE && /* don't check numbers */
+              !word_is_correct (spell, tag, w->str, w->len))
+            more = func (w->str, paragraph + word.byte_start - text, w->len, data);
+        }
+      segment_iter_clear (&words);
     }
+  g_string_free (w, TRUE);
+
+  return more;
 }
 
-static void
-gtk_spell_checker_class_init (GtkSpellCheckerClass *klass)
+static gboolean
+check_text_append (const gchar *word, gsize offset, gsize len, gpointer data)
 {
-  g_type_class_add_private (klass, sizeof (GtkSpellCheckerPrivate));
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
-  object_class->dispose = gtk_spell_checker_dispose;
-  object_class->finalize = gtk_spell_checker_finalize;
-  object_class->set_property = gtk_spell_checker_set_property;
-  object_class->get_property = gtk_spell_checker_get_property;
-
-  /**
-   * GtkSpellChecker::language-changed:
-   * @spell: the #GtkSpellChecker object which received the signal.
-   * @lang: the new language which was selected.
-   *
-   * The ::language-changed signal is emitted when the user selects
-   * a new spelling language from the context menu.
-   *
-   */
-  signals[LANGUAGE_CHANGED] = g_signal_new ("language-changed",
-                      G_OBJECT_CLASS_TYPE (object_class),
-                      G_SIGNAL_RUN_LAST,
-                      G_STRUCT_OFFSET (GtkSpellCheckerClass, language_changed),
-                      NULL, NULL,
-                      g_cclosure_marshal_VOID__STRING,
-                      G_TYPE_NONE,
-                      1,
-                      G_TYPE_STRING | G_SIGNAL_TYPE_STATIC_SCOPE);
+  GtkSpellMisspelling misspelling;
 
-  /**
-   * GtkSpellChecker::decode-language-codes:
-   *
-   * Whether to show decoded language codes in the context menu
-   * (requires the iso-codes package).
-   */
-  g_object_class_install_property (object_class, PROP_DECODE_LANGUAGE_CODES,
-        g_param_spec_boolean ("decode-language-codes",
-                              "Decode language codes",
-                              "Whether to show decoded language codes in the "\
-                              "context menu (requires the iso-codes package).",
-                              FALSE,
-                              G_PARAM_READWRITE));
+  misspelling.offset = offset;
+  misspelling.length = len;
+  g_array_append_val ((GArray *) data, misspelling);
+  return TRUE;
 }
 
-static void
-gtk_spell_checker_init (GtkSpellChecker *self)
+/**
+ * gtk_spell_checker_check_text:
+ * @spell: The #GtkSpellChecker object.
+ * @text: The UTF-8 text to check.
+ * @length: The length of @text in bytes, or -1 if it is nul-terminated.
+ *
+ * Checks a text without a #GtkTextView, finding the words just like the
+ * checker does in a buffer. With #GtkSpellChecker:detect-language set,
+ * each paragraph is checked in its detected language.
+ *
+ * Returns: (transfer full) (element-type GtkSpellMisspelling): the
+ * misspelled words, in the order they appear in @text, or %NULL if @text
+ * is not valid UTF-8. Use g_array_unref to free the array after use.
+ *
+ * Since: 3.0.11
+ */
+GArray *
+gtk_spell_checker_check_text (GtkSpellChecker *spell, const gchar *text,
+                              gssize length)
 {
-  self->priv = GTK_SPELL_CHECKER_GET_PRIVATE (self);
-  self->priv->view = NULL;
-  self->priv->buffer = NULL;
-  self->priv->tag_highlight = NULL;
-  self->priv->mark_insert_start = NULL;
-  self->priv->mark_insert_end = NULL;
-  self->priv->mark_click = NULL;
-  self->priv->deferred_check = FALSE;
-  self->priv->speller = NULL;
-  self->priv->lang = NULL;
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), NULL);
+  g_return_val_if_fail (text != NULL, NULL);
+  g_return_val_if_fail (spell->priv->speller != NULL, NULL);
 
-#ifdef ENABLE_NLS
-  bindtextdomain (PACKAGE_NAME, PACKAGE_LOCALE_DIR);
-  bind_textdomain_codeset (PACKAGE_NAME, "UTF-8");
-#endif
+  GArray *misspellings;
 
-  if (!broker)
-    {
-      broker = enchant_broker_init ();
-      broker_ref_cnt = 0;
-    }
-  broker_ref_cnt++;
+  if (length < 0)
+    length = strlen (text);
+  /* the text may come from anywhere, so this is no programming error */
+  if (!g_utf8_validate (text, length, NULL))
+    return NULL;
 
-#ifdef HAVE_ISO_CODES
-  if (codetable_ref_cnt == 0)
-    codetable_init ();
-  codetable_ref_cnt++;
-#endif
+  misspellings = g_array_new (FALSE, FALSE, sizeof (GtkSpellMisspelling));
+  check_text (spell, text, length, check_text_append, misspellings);
 
-  set_language_internal (self, NULL, NULL);
+  return misspellings;
 }
 
-static void
-gtk_spell_checker_dispose (GObject *object)
+/**
+ * gtk_spell_checker_check_bytes:
+ * @spell: The #GtkSpellChecker object.
+ * @bytes: The UTF-8 text to check.
+ *
+ * Like gtk_spell_checker_check_text(), for text held in a #GBytes.
+ *
+ * Returns: (transfer full) (element-type GtkSpellMisspelling): the
+ * misspelled words, in the order they appear in @bytes, or %NULL if
+ * @bytes is not valid UTF-8. Use g_array_unref to free the array after
+ * use.
+ *
+ * Since: 3.0.11
+ */
+GArray *
+gtk_spell_checker_check_bytes (GtkSpellChecker *spell, GBytes *bytes)
 {
-  GtkSpellChecker *spell = GTK_SPELL_CHECKER (object);
+  g_return_val_if_fail (bytes != NULL, NULL);
 
-  gtk_spell_checker_detach (spell);
+  gconstpointer data;
+  gsize size;
 
-  G_INITIALLY_UNOWNED_CLASS (gtk_spell_checker_parent_class)->dispose (object);
+  data = g_bytes_get_data (bytes, &size);
+  return gtk_spell_checker_check_text (spell, data ? data : "", size);
 }
 
-static void
-gtk_spell_checker_finalize (GObject *object)
+typedef struct _StreamCheck StreamCheck;
+struct _StreamCheck
 {
-  GtkSpellChecker *spell = GTK_SPELL_CHECKER (object);
+  GtkSpellChecker *spell;
+  GtkSpellMisspellingFunc func;
+  gpointer user_data;
+  guint64 base; /* the offset of the buffer in the stream */
+};
 
-  if (broker)
-    {
-      if (spell->priv->speller)
-        enchant_broker_free_dict (broker, spell->priv->speller);
-      broker_ref_cnt--;
-      if (broker_ref_cnt == 0)
-        {
-          enchant_broker_free (broker);
-          broker = NULL;
-        }
+static gboolean
+stream_check_word (const gchar *word, gsize offset, gsize len, gpointer data)
+{
+  StreamCheck *check = data;
 
-#ifdef HAVE_ISO_CODES
-      codetable_ref_cnt--;
-      if (codetable_ref_cnt == 0)
-        codetable_free ();
-#endif
+  return check->func (check->spell, word, check->base + offset, len,
+                      check->user_data);
+}
 
-    }
+/* returns how much of the @filled bytes of @buf can be checked without
+ * splitting a word, or 0 to read more first. a paragraph boundary is
+ * preferred, so that detecting languages sees whole paragraphs, then
+ * white space, which no word rule joins across. */
+static gsize
+stream_cut (const gchar *buf, gsize filled)
+{
+  const gchar *p;
+  gsize i;
 
-  g_free (spell->priv->lang);
+  for (i = filled; i > 0; i--)
+    if (buf[i - 1] == '\n' || buf[i - 1] == '\r')
+      return i;
 
-  G_INITIALLY_UNOWNED_CLASS (gtk_spell_checker_parent_class)->finalize (object);
+  for (i = filled; i > 0; i--)
+    if (buf[i - 1] == ' ' || buf[i - 1] == '\t')
+      return i;
+
+  /* a word as long as the buffer has to be split somewhere */
+  if (filled == STREAM_BUFFER_SIZE)
+    {
+      p = g_utf8_find_prev_char (buf, buf + filled);
+      return p && p > buf ? (gsize) (p - buf) : filled;
+    }
+
+  return 0;
 }
 
 /**
- * gtk_spell_checker_new:
+ * gtk_spell_checker_check_stream:
+ * @spell: The #GtkSpellChecker object.
+ * @stream: The UTF-8 text to check.
+ * @func: (scope call): The function to call with each misspelled word.
+ * @user_data: (closure): The data to pass to @func.
+ * @cancellable: (allow-none): A #GCancellable, or %NULL.
+ * @error: (out) (allow-none): Return location for error.
  *
- * Create a new #GtkSpellChecker object.
+ * Checks the text read from @stream like gtk_spell_checker_check_text(),
+ * in chunks and with bounded memory, however long the text is. The text
+ * is checked up to the last line break or white space read so far, so
+ * that no word is split between chunks. Only a single word longer than
+ * the buffer of about 1 MiB is checked in parts.
  *
- * Returns: a new #GtkSpellChecker object.
+ * The stream is read synchronously; run the check in a thread to keep a
+ * user interface responsive.
+ *
+ * Returns: FALSE if reading failed, the text is not valid UTF-8 or the
+ * check was cancelled. A check stopped by @func is not an error.
+ *
+ * Since: 3.0.11
  */
-GtkSpellChecker*
-gtk_spell_checker_new (void)
+gboolean
+gtk_spell_checker_check_stream (GtkSpellChecker *spell,
+                                GInputStream *stream,
+                                GtkSpellMisspellingFunc func,
+                                gpointer user_data,
+                                GCancellable *cancellable,
+                                GError **error)
 {
-  return g_object_new (GTK_SPELL_TYPE_CHECKER, NULL);
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), FALSE);
+  g_return_val_if_fail (G_IS_INPUT_STREAM (stream), FALSE);
+  g_return_val_if_fail (func != NULL, FALSE);
+  g_return_val_if_fail (spell->priv->speller != NULL, FALSE);
+
+  StreamCheck check = { spell, func, user_data, 0 };
+  gchar *buf;
+  gsize filled = 0, cut;
+  gssize n;
+  gboolean ok = TRUE, more = TRUE;
+
+  buf = g_malloc (STREAM_BUFFER_SIZE);
+  while (more)
+    {
+      n = g_input_stream_read (stream, buf + filled,
+                               MIN (STREAM_CHUNK_SIZE, STREAM_BUFFER_SIZE - filled),
+                               cancellable, error);
+      if (n < 0)
+        {
+          ok = FALSE;
+          break;
+        }
+      filled += n;
+
+      cut = n == 0 ? filled : stream_cut (buf, filled);
+      if (cut > 0)
+        {
+          if (!g_utf8_validate (buf, cut, NULL))
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           _("The text is not valid UTF-8"));
+              ok = FALSE;
+              break;
+            }
+
+          more = check_text (spell, buf, cut, stream_check_word, &check);
+
+          memmove (buf, buf + cut, filled - cut);
+          filled -= cut;
+          check.base += cut;
+        }
+
+      if (n == 0)
+        break;
+    }
+  g_free (buf);
+
+  return ok;
 }
 
 /**
- * gtk_spell_checker_attach:
- * @spell: A #GtkSpellChecker.
- * @view: The #GtkTextView to attach to.
- *
- * Attach #GtkSpellChecker object to @view.
- *
- * Note: Please read the tutorial section of the documentation to make sure
- * you don't leak references!
+ * gtk_spell_checker_recheck_all:
+ * @spell: The #GtkSpellChecker object.
  *
- * Returns: TRUE on success, FALSE on failure.
+ * Recheck the spelling in the entire buffer. If #GtkSpellChecker:incremental
+ * is set, the check runs in the background and this function returns
+ * immediately, a check which is still running is restarted. The background
+ * check starts with the lines visible in the text view and works outwards
+ * from there, lines scrolled into view are checked first.
  */
-gboolean
-gtk_spell_checker_attach (GtkSpellChecker *spell, GtkTextView *view)
+void
+gtk_spell_checker_recheck_all (GtkSpellChecker *spell)
 {
-  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), FALSE);
-  g_return_val_if_fail (GTK_IS_TEXT_VIEW (view), FALSE);
-  g_return_val_if_fail (gtk_text_view_get_buffer (view), FALSE);
-  g_return_val_if_fail (spell->priv->view == NULL, FALSE);
-
-  /* ensure no existing instance is attached */
-  GtkSpellChecker *attached;
-  attached = g_object_get_data (G_OBJECT (view), GTK_SPELL_OBJECT_KEY);
-  g_return_val_if_fail (attached == NULL, FALSE);
+  g_return_if_fail (GTK_SPELL_IS_CHECKER (spell));
 
-  /* attach to the widget */
-  spell->priv->view = view;
-  g_object_ref (view);
-  g_object_ref_sink (spell);
+  GtkTextIter start, end;
 
-  g_object_set_data (G_OBJECT (view), GTK_SPELL_OBJECT_KEY, spell);
+  if (!spell->priv->buffer || !spell->priv->speller)
+    return;
 
-  g_signal_connect_swapped (view, "destroy",
-                            G_CALLBACK (gtk_spell_checker_detach), spell);
-  g_signal_connect (view, "button-press-event",
-                    G_CALLBACK (button_press_event), spell);
-  g_signal_connect (view, "populate-popup",
-                    G_CALLBACK (populate_popup), spell);
-  g_signal_connect (view, "popup-menu",
-                    G_CALLBACK (popup_menu_event), spell);
-  g_signal_connect (view, "notify::buffer",
-                    G_CALLBACK (buffer_changed), spell);
+  recheck_cancel (spell);
+  gtk_text_buffer_get_bounds (spell->priv->buffer, &start, &end);
 
-  set_buffer (spell, gtk_text_view_get_buffer (view));
+  if (spell->priv->incremental)
+    {
+      gtk_text_buffer_move_mark (spell->priv->buffer,
+                                 spell->priv->mark_recheck_top, &start);
+      gtk_text_buffer_move_mark (spell->priv->buffer,
+                                 spell->priv->mark_recheck_bottom, &start);
+      recheck_visible (spell);
+      set_progress (spell, 0.0);
+      spell->priv->recheck_source = g_idle_add (recheck_step, spell);
+      return;
+    }
 
-  return TRUE;
+  if (spell->priv->threaded && g_get_num_processors () > 1 &&
+      gtk_text_buffer_get_char_count (spell->priv->buffer) >= SHARD_MIN_CHARS)
+    recheck_sharded (spell);
+  else
+    check_range (spell, start, end, TRUE);
+  if (debug)
+    g_print ("word cache: %u hits, %u misses, %u evictions\n",
+             word_cache_hits, word_cache_misses, word_cache_evictions);
+  g_signal_emit (spell, signals[CHECK_COMPLETE], 0);
 }
 
 /**
- * gtk_spell_checker_detach:
- * @spell: A #GtkSpellChecker.
+ * gtk_spell_checker_add_to_dictionary:
+ * @spell: The #GtkSpellChecker object.
+ * @word:  The word to add to the user dictionary.
  *
- * Detaches this #GtkSpellChecker from its #GtkTextView.  Use
- * gtk_spell_checker_get_from_text_view () to retrieve a #GtkSpellChecker from
- * a #GtkTextView. If the #GtkSpellChecker is not attached to any #GtkTextView,
- * the function silently exits.
+ * Add the specified word to the user dictionary.
  *
- * Note: if the #GtkSpellChecker is owned by the #GtkTextView, you must
- * take a reference to it to prevent it from being automatically destroyed.
- * Please read the tutorial section of the documentation!
+ * Since: 3.0.9
  */
 void
-gtk_spell_checker_detach (GtkSpellChecker *spell)
+gtk_spell_checker_add_to_dictionary (GtkSpellChecker *spell, const gchar *word)
 {
   g_return_if_fail (GTK_SPELL_IS_CHECKER (spell));
-  if (spell->priv->view == NULL)
-    return;
-
-  g_signal_handlers_disconnect_matched (spell->priv->view, G_SIGNAL_MATCH_DATA,
-        0, 0, NULL, NULL, spell);
-
-  g_object_set_data (G_OBJECT (spell->priv->view), GTK_SPELL_OBJECT_KEY, NULL);
+  g_return_if_fail (word != NULL);
+  g_return_if_fail (spell->priv->speller != NULL);
 
-  g_object_unref (spell->priv->view);
-  spell->priv->view = NULL;
-  set_buffer (spell, NULL);
-  spell->priv->deferred_check = FALSE;
-  g_object_unref (spell);
+  G_LOCK (speller);
+  enchant_dict_add (spell->priv->speller, word, strlen (word));
+  word_cache_invalidate (spell->priv->word_cache, word);
+  word_cache_add_personal (spell->priv->word_cache, word);
+  G_UNLOCK (speller);
+  check_jobs_invalidate (spell, NULL, NULL);
+  unhighlight_word (spell, word);
 }
 
 /**
- * gtk_spell_checker_get_from_text_view:
- * @view: A #GtkTextView.
+ * gtk_spell_checker_ignore_word:
+ * @spell: The #GtkSpellChecker object.
+ * @word:  The word to add to the user ignore list.
  *
- * Retrieves the #GtkSpellChecker object attached to a text view.
+ * Add the specified word to the user ignore list.
  *
- * Returns: (transfer none): the #GtkSpellChecker object, or %NULL if there is no #GtkSpellChecker
- * attached to @view.
+ * Since: 3.0.9
  */
-GtkSpellChecker*
-gtk_spell_checker_get_from_text_view (GtkTextView *view)
+void
+gtk_spell_checker_ignore_word (GtkSpellChecker *spell, const gchar *word)
 {
-  g_return_val_if_fail (GTK_IS_TEXT_VIEW (view), NULL);
-  return g_object_get_data (G_OBJECT (view), GTK_SPELL_OBJECT_KEY);
+  g_return_if_fail (GTK_SPELL_IS_CHECKER (spell));
+  g_return_if_fail (word != NULL);
+  g_return_if_fail (spell->priv->speller != NULL);
+
+  G_LOCK (speller);
+  enchant_dict_add_to_session (spell->priv->speller, word, strlen (word));
+  word_cache_invalidate (spell->priv->word_cache, word);
+  word_cache_add_session (spell->priv->word_cache, word);
+  G_UNLOCK (speller);
+  check_jobs_invalidate (spell, NULL, NULL);
+  unhighlight_word (spell, word);
 }
 
 /**
- * gtk_spell_checker_get_language:
- * @spell: a #GtkSpellChecker
+ * gtk_spell_checker_get_next_misspelling:
+ * @spell: The #GtkSpellChecker object.
+ * @iter: The position to search from.
+ * @start: (out caller-allocates) (optional): Return location for the start
+ *   of the misspelled word, or %NULL.
+ * @end: (out caller-allocates) (optional): Return location for the end of
+ *   the misspelled word, or %NULL.
  *
- * Fetches the current language.
+ * Find the first misspelled word starting after @iter. Only the words which
+ * have already been checked are found, see #GtkSpellChecker::check-complete.
  *
- * Returns: the current language. This string is
- * owned by the spell object and must not be modified or freed.
- **/
-const gchar*
-gtk_spell_checker_get_language (GtkSpellChecker *spell)
+ * Returns: TRUE if a misspelled word was found, FALSE otherwise.
+ *
+ * Since: 3.0.11
+ */
+gboolean
+gtk_spell_checker_get_next_misspelling (GtkSpellChecker *spell,
+                                        const GtkTextIter *iter,
+                                        GtkTextIter *start, GtkTextIter *end)
 {
-  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), NULL);
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), FALSE);
+  g_return_val_if_fail (iter != NULL, FALSE);
 
-  return spell->priv->lang;
+  if (!spell->priv->buffer)
+    return FALSE;
+
+  return misspelling_get_range (spell,
+                                misspelling_search (spell, gtk_text_iter_get_offset (iter)),
+                                start, end);
 }
 
 /**
- * gtk_spell_checker_get_language_list:
+ * gtk_spell_checker_get_previous_misspelling:
+ * @spell: The #GtkSpellChecker object.
+ * @iter: The position to search from.
+ * @start: (out caller-allocates) (optional): Return location for the start
+ *   of the misspelled word, or %NULL.
+ * @end: (out caller-allocates) (optional): Return location for the end of
+ *   the misspelled word, or %NULL.
  *
- * Requests the list of available languages from the enchant broker.
+ * Find the last misspelled word starting before @iter.
  *
- * Returns: (transfer full) (element-type utf8): a #GList of the available languages.
- * Use g_list_free_full with g_free to free the list after use.
+ * Returns: TRUE if a misspelled word was found, FALSE otherwise.
  *
- * Since: 3.0.3
+ * Since: 3.0.11
  */
-GList*
-gtk_spell_checker_get_language_list (void)
+gboolean
+gtk_spell_checker_get_previous_misspelling (GtkSpellChecker *spell,
+                                            const GtkTextIter *iter,
+                                            GtkTextIter *start, GtkTextIter *end)
 {
-  struct _languages_cb_struct languages_cb_struct;
+  GSequenceIter *pos;
 
-  if (!broker)
-    {
-      broker = enchant_broker_init();
-      broker_ref_cnt = 0;
-    }
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), FALSE);
+  g_return_val_if_fail (iter != NULL, FALSE);
 
-  languages_cb_struct.langs = NULL;
-  enchant_broker_list_dicts(broker, dict_describe_cb, &languages_cb_struct);
+  if (!spell->priv->buffer)
+    return FALSE;
 
-  if (broker_ref_cnt == 0)
-    {
-      enchant_broker_free (broker);
-      broker = NULL;
-    }
+  /* the first entry starting at or after iter, and the one before it */
+  pos = misspelling_search (spell, gtk_text_iter_get_offset (iter) - 1);
+  if (g_sequence_iter_is_begin (pos))
+    return FALSE;
 
-  return languages_cb_struct.langs;
+  return misspelling_get_range (spell, g_sequence_iter_prev (pos), start, end);
 }
 
 /**
- * gtk_spell_checker_decode_language_code:
- * @lang: The language locale specifier (i.e. "en_US").
+ * gtk_spell_checker_get_misspelling_count:
+ * @spell: The #GtkSpellChecker object.
  *
- * Translates the language code to a human readable format
- * (i.e. "en_US" -> "English (United States)").
- * Note: If the iso-codes package is not available, the unchanged code is
- * returned.
+ * Get the number of misspelled words found in the buffer.
  *
- * Returns: (transfer full): The translated language specifier. Use g_free to
- * free the returned string after use.
+ * Returns: the number of misspelled words.
  *
- * Since: 3.0.3
+ * Since: 3.0.11
  */
-gchar*
-gtk_spell_checker_decode_language_code (const gchar *lang)
+guint
+gtk_spell_checker_get_misspelling_count (GtkSpellChecker *spell)
 {
-  gchar* result;
-#ifdef HAVE_ISO_CODES
-  const gchar *lang_name = "\0";
-  const gchar *country_name = "\0";
-  if (codetable_ref_cnt == 0)
-    codetable_init ();
-  codetable_lookup (lang, &lang_name, &country_name);
-  if (strlen (country_name) != 0)
-    result = g_strdup_printf ("%s (%s)", lang_name, country_name);
-  else
-    result = g_strdup_printf ("%s", lang_name);
-  if (codetable_ref_cnt == 0)
-    codetable_free ();
-#else
-  result = g_strdup (lang);
-#endif
-  return result;
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), 0);
+
+  return g_sequence_get_length (spell->priv->misspelling_ranges);
 }
 
 /**
- * gtk_spell_checker_set_language:
+ * gtk_spell_checker_get_nth_misspelling:
  * @spell: The #GtkSpellChecker object.
- * @lang: (allow-none): The language to use, as a locale specifier (i.e. "en_US").
- * If #NULL, attempt to use the default system locale (LANG).
- * @error: (out) (allow-none): Return location for error.
+ * @n: The index of the misspelled word, in buffer order.
+ * @start: (out caller-allocates) (optional): Return location for the start
+ *   of the misspelled word, or %NULL.
+ * @end: (out caller-allocates) (optional): Return location for the end of
+ *   the misspelled word, or %NULL.
  *
- * Set the language on @spell to @lang, possibily returning an error in
- * @error.
+ * Get the range of the @n-th misspelled word of the buffer. Together with
+ * gtk_spell_checker_get_misspelling_count() this allows to iterate all the
+ * misspelled words.
  *
- * Returns: FALSE if there was an error.
+ * Returns: TRUE if @n is less than the number of misspelled words, FALSE
+ * otherwise.
+ *
+ * Since: 3.0.11
  */
 gboolean
-gtk_spell_checker_set_language (GtkSpellChecker *spell, const gchar *lang, GError **error)
+gtk_spell_checker_get_nth_misspelling (GtkSpellChecker *spell, guint n,
+                                       GtkTextIter *start, GtkTextIter *end)
 {
   g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), FALSE);
 
-  if (error)
-    g_return_val_if_fail (*error == NULL, FALSE);
-
-  gboolean ret = set_language_internal (spell, lang, error);
-  if (ret)
-    gtk_spell_checker_recheck_all (spell);
+  if (n >= (guint) g_sequence_get_length (spell->priv->misspelling_ranges))
+    return FALSE;
 
-  return ret;
+  return misspelling_get_range (spell,
+                                g_sequence_get_iter_at_pos (spell->priv->misspelling_ranges, n),
+                                start, end);
 }
 
 /**
- * gtk_spell_checker_check_word:
- * @spell: The #GtkSpellChecker object.
- * @word: The word to check.
+ * gtk_spell_checker_get_suggestions:
+ * @spell: A #GtkSpellChecker.
+ * @word: The word for which to fetch suggestions
  *
- * Check the specified word.
+ * Retreives a list of spelling suggestions for the specified word.
  *
- * Returns: TRUE if the word is correctly spelled, FALSE otherwise.
+ * Returns: (transfer full) (element-type utf8): the list of spelling
+ * suggestions for the specified word, or NULL if there are no suggestions.
  *
  * Since: 3.0.8
  */
-gboolean
-gtk_spell_checker_check_word (GtkSpellChecker *spell, const gchar *word)
+GList*
+gtk_spell_checker_get_suggestions (GtkSpellChecker *spell, const gchar* word)
 {
-  if (g_unichar_isdigit (*word) == TRUE || /* don't check numbers */
-      enchant_dict_check (spell->priv->speller, word, strlen (word)) == 0)
-    return TRUE;
-  return FALSE;
+  return suggest_word (spell, word, FALSE, NULL);
 }
 
-/**
- * gtk_spell_checker_recheck_all:
- * @spell: The #GtkSpellChecker object.
- *
- * Recheck the spelling in the entire buffer.
- */
-void
-gtk_spell_checker_recheck_all (GtkSpellChecker *spell)
+static void
+get_suggestions_thread (GTask *task, gpointer source, gpointer data,
+                        GCancellable *cancellable)
 {
-  g_return_if_fail (GTK_SPELL_IS_CHECKER (spell));
+  if (g_task_return_error_if_cancelled (task))
+    return;
+  g_task_return_pointer (task, suggest_word (source, data, FALSE, cancellable),
+                         (GDestroyNotify) suggestions_free);
+}
 
-  GtkTextIter start, end;
+static void
+get_suggestions_spare_thread (GTask *task, gpointer source, gpointer data,
+                              GCancellable *cancellable)
+{
+  if (g_task_return_error_if_cancelled (task))
+    return;
+  g_task_return_pointer (task, suggest_word (source, data, TRUE, cancellable),
+                         (GDestroyNotify) suggestions_free);
+}
 
-  if (spell->priv->buffer)
-    {
-      gtk_text_buffer_get_bounds (spell->priv->buffer, &start, &end);
-      check_range (spell, start, end, TRUE);
-    }
+/* starts a lookup for gtk_spell_checker_get_suggestions_finish(), with a
+ * spare dictionary if @use_spare is set */
+static void
+suggest_word_async (GtkSpellChecker *spell, const gchar *word, gboolean use_spare,
+                    GCancellable *cancellable, GAsyncReadyCallback callback,
+                    gpointer user_data)
+{
+  GTask *task;
+
+  task = g_task_new (spell, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gtk_spell_checker_get_suggestions_async);
+  g_task_set_task_data (task, g_strdup (word), g_free);
+  g_task_set_return_on_cancel (task, TRUE);
+  g_task_run_in_thread (task, use_spare ? get_suggestions_spare_thread
+                                        : get_suggestions_thread);
+  g_object_unref (task);
 }
 
 /**
- * gtk_spell_checker_add_to_dictionary:
- * @spell: The #GtkSpellChecker object.
- * @word:  The word to add to the user dictionary.
+ * gtk_spell_checker_get_suggestions_async:
+ * @spell: A #GtkSpellChecker.
+ * @word: The word for which to fetch suggestions
+ * @cancellable: (allow-none): A #GCancellable, or %NULL.
+ * @callback: (scope async): The callback to call when the suggestions are
+ *   ready.
+ * @user_data: (closure): The data to pass to @callback.
  *
- * Add the specified word to the user dictionary.
+ * Retrieves a list of spelling suggestions for the specified word in a
+ * worker thread, since the backend can take a noticeable time for long or
+ * garbled words. When cancelled, @callback is called right away even if the
+ * backend is still busy. Call gtk_spell_checker_get_suggestions_finish()
+ * from @callback to get the result.
  *
- * Since: 3.0.9
+ * If #GtkSpellChecker:threaded is set, the suggestions are looked up with
+ * a second instance of the dictionary, loaded on first use and kept as
+ * long as the dictionary, so that spell checking carries on meanwhile.
+ *
+ * Since: 3.0.11
  */
 void
-gtk_spell_checker_add_to_dictionary (GtkSpellChecker *spell, const gchar *word)
+gtk_spell_checker_get_suggestions_async (GtkSpellChecker *spell,
+                                         const gchar *word,
+                                         GCancellable *cancellable,
+                                         GAsyncReadyCallback callback,
+                                         gpointer user_data)
 {
-  enchant_dict_add (spell->priv->speller, word, strlen (word));
-  gtk_spell_checker_recheck_all (spell);
+  g_return_if_fail (GTK_SPELL_IS_CHECKER (spell));
+  g_return_if_fail (word != NULL);
+
+  suggest_word_async (spell, word, spell->priv->threaded,
+                      cancellable, callback, user_data);
 }
 
 /**
- * gtk_spell_checker_ignore_word:
- * @spell: The #GtkSpellChecker object.
- * @word:  The word to add to the user ignore list.
+ * gtk_spell_checker_get_suggestions_finish:
+ * @spell: A #GtkSpellChecker.
+ * @result: The #GAsyncResult passed to the callback.
+ * @error: (allow-none): Return location for error, or %NULL.
  *
- * Add the specified word to the user ignore list.
+ * Finishes a lookup started with gtk_spell_checker_get_suggestions_async().
  *
- * Since: 3.0.9
+ * Returns: (transfer full) (element-type utf8): the list of spelling
+ * suggestions for the word, or NULL if there are no suggestions or if the
+ * lookup was cancelled.
+ *
+ * Since: 3.0.11
  */
-void
-gtk_spell_checker_ignore_word (GtkSpellChecker *spell, const gchar *word)
+GList*
+gtk_spell_checker_get_suggestions_finish (GtkSpellChecker *spell,
+                                          GAsyncResult *result,
+                                          GError **error)
 {
-  enchant_dict_add_to_session (spell->priv->speller, word, strlen (word));
-  gtk_spell_checker_recheck_all (spell);
+  g_return_val_if_fail (g_task_is_valid (result, spell), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+typedef struct _TimedLookup TimedLookup;
+struct _TimedLookup
+{
+  gchar *word;
+  WordCache *cache; /* lists the word as pending */
+  GAsyncQueue *results;
+};
+
+static void
+timed_lookup_free (TimedLookup *lookup)
+{
+  G_LOCK (word_lists);
+  g_hash_table_remove (lookup->cache->pending, lookup->word);
+  G_UNLOCK (word_lists);
+
+  G_LOCK (speller);
+  word_cache_unref (lookup->cache);
+  G_UNLOCK (speller);
+
+  g_async_queue_unref (lookup->results);
+  g_free (lookup->word);
+  g_slice_free (TimedLookup, lookup);
+}
+
+static void
+timed_lookup_thread (GTask *task, gpointer source, gpointer data,
+                     GCancellable *cancellable)
+{
+  TimedLookup *lookup = data;
+  GList *suggestions, *l;
+  gchar **strv;
+  gint i;
+
+  /* the lookup caches its result, which matters when it's late */
+  suggestions = suggest_word (source, lookup->word,
+                              GTK_SPELL_CHECKER (source)->priv->threaded, NULL);
+  strv = g_new0 (gchar *, g_list_length (suggestions) + 1);
+  for (l = suggestions, i = 0; l; l = l->next, i++)
+    strv[i] = l->data;
+  g_list_free (suggestions);
+
+  g_async_queue_push (lookup->results, strv);
+  g_task_return_boolean (task, TRUE);
 }
 
 /**
- * gtk_spell_checker_get_suggestions:
+ * gtk_spell_checker_get_suggestions_with_timeout:
  * @spell: A #GtkSpellChecker.
  * @word: The word for which to fetch suggestions
+ * @timeout_ms: The time to wait for the backend, in milliseconds.
+ * @truncated: (out) (allow-none): Return location for whether the backend
+ *   missed the deadline, or %NULL.
  *
- * Retreives a list of spelling suggestions for the specified word.
+ * Retrieves a list of spelling suggestions for the specified word, waiting
+ * no longer than @timeout_ms for the backend. If the backend misses the
+ * deadline, the suggestions are picked among the words of the personal
+ * dictionary and of the ignore list, and among recent replacements, which
+ * are the closest to @word, and @truncated is set. The backend lookup
+ * still completes in the background, later calls for the same word then
+ * get its result right away. Until it does, they get the fallback
+ * suggestions without waiting.
  *
  * Returns: (transfer full) (element-type utf8): the list of spelling
  * suggestions for the specified word, or NULL if there are no suggestions.
  *
- * Since: 3.0.8
+ * Since: 3.0.11
  */
 GList*
-gtk_spell_checker_get_suggestions (GtkSpellChecker *spell, const gchar* word)
+gtk_spell_checker_get_suggestions_with_timeout (GtkSpellChecker *spell,
+                                                const gchar *word,
+                                                guint timeout_ms,
+                                                gboolean *truncated)
 {
-  char **suggestions;
-  size_t n_suggs, i;
-  GList* result = NULL;
-  suggestions = enchant_dict_suggest (spell->priv->speller, word,
-                                      strlen (word), &n_suggs);
-  for (i = 0; i < n_suggs; ++i)
+  WordCache *cache;
+  TimedLookup *lookup;
+  GAsyncQueue *results;
+  GList *result = NULL;
+  gboolean pending;
+  gchar **strv;
+  GTask *task;
+
+  g_return_val_if_fail (GTK_SPELL_IS_CHECKER (spell), NULL);
+  g_return_val_if_fail (word != NULL, NULL);
+
+  if (truncated)
+    *truncated = FALSE;
+
+  cache = spell->priv->word_cache;
+  if (!cache)
+    return NULL;
+
+  if (suggest_word_cached (cache, word, &result))
+    return result;
+
+  /* a lookup which missed an earlier deadline is still running, waiting
+   * for it again would only start one more behind it */
+  G_LOCK (word_lists);
+  pending = g_hash_table_contains (cache->pending, word);
+  if (!pending)
+    g_hash_table_add (cache->pending, g_strdup (word));
+  G_UNLOCK (word_lists);
+  if (pending)
+    {
+      if (truncated)
+        *truncated = TRUE;
+      return suggest_word_fallback (spell, word);
+    }
+
+  /* the lookup may outlive the wait, so both hold the queue */
+  results = g_async_queue_new_full ((GDestroyNotify) g_strfreev);
+  lookup = g_slice_new (TimedLookup);
+  lookup->word = g_strdup (word);
+  G_LOCK (speller);
+  lookup->cache = cache;
+  cache->ref_cnt++;
+  G_UNLOCK (speller);
+  lookup->results = g_async_queue_ref (results);
+
+  task = g_task_new (spell, NULL, NULL, NULL);
+  g_task_set_task_data (task, lookup, (GDestroyNotify) timed_lookup_free);
+  g_task_run_in_thread (task, timed_lookup_thread);
+  g_object_unref (task);
+
+  strv = g_async_queue_timeout_pop (results, (guint64) timeout_ms * 1000);
+  g_async_queue_unref (results);
+
+  if (strv)
     {
-      result = g_list_append (result, g_strdup (suggestions[i]));
+      result = suggestions_to_list (strv);
+      g_strfreev (strv);
     }
+  else
+    {
+      result = suggest_word_fallback (spell, word);
+      if (truncated)
+        *truncated = TRUE;
+    }
+
   return result;
 }
 
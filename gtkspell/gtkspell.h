@@ -77,6 +77,42 @@ struct _GtkSpellChecker
   GtkSpellCheckerPrivate *priv;
 };
 
+/**
+ * GtkSpellMisspelling:
+ * @offset: The byte offset of the misspelled word in the checked text.
+ * @length: The length of the word in bytes.
+ *
+ * A misspelled word found by gtk_spell_checker_check_text().
+ *
+ * Since: 3.0.11
+ */
+typedef struct _GtkSpellMisspelling GtkSpellMisspelling;
+struct _GtkSpellMisspelling
+{
+  gsize offset;
+  gsize length;
+};
+
+/**
+ * GtkSpellMisspellingFunc:
+ * @spell: The #GtkSpellChecker object.
+ * @word: The misspelled word, nul-terminated.
+ * @offset: The byte offset of @word in the stream.
+ * @length: The length of @word in bytes.
+ * @user_data: The data passed to gtk_spell_checker_check_stream().
+ *
+ * Called by gtk_spell_checker_check_stream() with each misspelled word.
+ *
+ * Returns: FALSE to stop the check.
+ *
+ * Since: 3.0.11
+ */
+typedef gboolean (*GtkSpellMisspellingFunc) (GtkSpellChecker *spell,
+                                             const gchar     *word,
+                                             guint64          offset,
+                                             guint            length,
+                                             gpointer         user_data);
+
 typedef struct _GtkSpellCheckerClass   GtkSpellCheckerClass;
 struct _GtkSpellCheckerClass
 {
@@ -95,21 +131,86 @@ GtkSpellChecker *gtk_spell_checker_get_from_text_view   (GtkTextView   *view);
 void             gtk_spell_checker_detach               (GtkSpellChecker *spell);
 GList           *gtk_spell_checker_get_suggestions      (GtkSpellChecker *spell,
                                                          const gchar* word);
+void             gtk_spell_checker_get_suggestions_async (GtkSpellChecker *spell,
+                                                         const gchar   *word,
+                                                         GCancellable  *cancellable,
+                                                         GAsyncReadyCallback callback,
+                                                         gpointer       user_data);
+GList           *gtk_spell_checker_get_suggestions_finish (GtkSpellChecker *spell,
+                                                         GAsyncResult  *result,
+                                                         GError       **error);
+GList           *gtk_spell_checker_get_suggestions_with_timeout (GtkSpellChecker *spell,
+                                                         const gchar   *word,
+                                                         guint          timeout_ms,
+                                                         gboolean      *truncated);
 GtkWidget       *gtk_spell_checker_get_suggestions_menu (GtkSpellChecker *spell,
                                                          GtkTextIter   *iter);
 gboolean         gtk_spell_checker_set_language         (GtkSpellChecker *spell,
                                                          const gchar   *lang,
                                                          GError       **error);
+void             gtk_spell_checker_set_language_async (GtkSpellChecker *spell,
+                                                      const gchar *lang,
+                                                      GCancellable *cancellable,
+                                                      GAsyncReadyCallback callback,
+                                                      gpointer user_data);
+gboolean         gtk_spell_checker_set_language_finish (GtkSpellChecker *spell,
+                                                       GAsyncResult *result,
+                                                       GError **error);
+gboolean         gtk_spell_checker_set_languages        (GtkSpellChecker *spell,
+                                                         const gchar * const *langs,
+                                                         GError       **error);
+gchar          **gtk_spell_checker_get_languages        (GtkSpellChecker *spell);
 const gchar     *gtk_spell_checker_get_language         (GtkSpellChecker *spell);
 GList           *gtk_spell_checker_get_language_list    (void);
+void             gtk_spell_checker_get_language_list_async (GCancellable *cancellable,
+                                                         GAsyncReadyCallback callback,
+                                                         gpointer       user_data);
+GList           *gtk_spell_checker_get_language_list_finish (GAsyncResult *result,
+                                                         GError       **error);
+void             gtk_spell_checker_set_dictionary_cache_limits (guint max_dictionaries,
+                                                             gsize max_bytes);
+void             gtk_spell_checker_get_cache_statistics (guint *hits,
+                                                         guint *misses,
+                                                         guint *evictions);
 gchar           *gtk_spell_checker_decode_language_code (const gchar *lang);
 gboolean         gtk_spell_checker_check_word           (GtkSpellChecker *spell,
                                                          const gchar *word);
+GArray          *gtk_spell_checker_check_words          (GtkSpellChecker *spell,
+                                                         const gchar * const *words);
+GArray          *gtk_spell_checker_check_words_packed   (GtkSpellChecker *spell,
+                                                         const gchar   *buffer,
+                                                         gsize          length,
+                                                         const guint   *offsets,
+                                                         gsize          n_offsets);
+GArray          *gtk_spell_checker_check_text           (GtkSpellChecker *spell,
+                                                         const gchar   *text,
+                                                         gssize         length);
+GArray          *gtk_spell_checker_check_bytes          (GtkSpellChecker *spell,
+                                                         GBytes        *bytes);
+gboolean         gtk_spell_checker_check_stream         (GtkSpellChecker *spell,
+                                                         GInputStream  *stream,
+                                                         GtkSpellMisspellingFunc func,
+                                                         gpointer       user_data,
+                                                         GCancellable  *cancellable,
+                                                         GError       **error);
 void             gtk_spell_checker_recheck_all          (GtkSpellChecker *spell);
 void             gtk_spell_checker_add_to_dictionary    (GtkSpellChecker *spell,
                                                          const gchar *word);
 void             gtk_spell_checker_ignore_word          (GtkSpellChecker *spell,
                                                          const gchar *word);
+gboolean         gtk_spell_checker_get_next_misspelling (GtkSpellChecker *spell,
+                                                         const GtkTextIter *iter,
+                                                         GtkTextIter   *start,
+                                                         GtkTextIter   *end);
+gboolean         gtk_spell_checker_get_previous_misspelling (GtkSpellChecker *spell,
+                                                         const GtkTextIter *iter,
+                                                         GtkTextIter   *start,
+                                                         GtkTextIter   *end);
+guint            gtk_spell_checker_get_misspelling_count (GtkSpellChecker *spell);
+gboolean         gtk_spell_checker_get_nth_misspelling  (GtkSpellChecker *spell,
+                                                         guint          n,
+                                                         GtkTextIter   *start,
+                                                         GtkTextIter   *end);
 
 G_END_DECLS
 